@@ -0,0 +1,405 @@
+// microbenchmarks for the hot paths of zt.c, which is compiled in as is.
+// The corpora are generated once into $TMPDIR and opened like any file;
+// each kernel reports ns per operation and MB/s (for the draws, of what
+// reaches the terminal), the median of several runs (the lowest of a few
+// such medians for a baseline or a kernel that looks slower), and is
+// compared with a baseline file of ns/op values that also records the
+// corpus sizes.
+//
+//   ./build bench            run, compare with bench.json
+//   ./build bench save       run and write bench.json
+//   zt-bench [-m MB] [-b FILE] [-t PERCENT] [-s]
+//
+// -m sets the size of the log corpus (1024 MB), -t the slowdown that
+// counts as a regression (60%: on a shared machine runs of an unchanged
+// tree differ by up to 50%). Kernels whose corpus had another size in
+// the baseline are not compared. The exit status is 1 on a regression
+#define main zt_main
+#include "zt.c"
+#undef main
+#include <time.h>
+
+enum { C_SRC, PROSE, LONGLINE, LOG, NCORPUS };
+
+struct corpus {
+  const char *file;
+  long size;
+  int buf;  // index into bufs once opened
+} corpora[NCORPUS] = {
+  [C_SRC] = { .file = "zt-bench-src.c", .size = 16 << 20 },
+  [PROSE] = { .file = "zt-bench-prose.txt", .size = 16 << 20 },
+  [LONGLINE] = { .file = "zt-bench-line.json", .size = 64 << 20 },
+  [LOG] = { .file = "zt-bench-log.log", .size = 1024L << 20 },
+};
+
+static unsigned long long rng = 88172645463325252ULL;
+static volatile long sink;  // results go here so no kernel is optimized away
+static long drawn;          // bytes the null terminal was sent
+
+static ssize_t null_write(void *cookie, const char *s, size_t n) {
+  (void)cookie;
+  (void)s;
+  drawn += n;
+  return n;
+}
+
+static unsigned rnd(unsigned n) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng % n;
+}
+
+static int by_time(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// corpus generators: each writes one record of roughly line-sized text
+static int gen_src(char *s) {
+  static const char *types[] = { "int", "long", "char *", "struct node *", "size_t" };
+  static const char *names[] = { "count", "value", "limit", "total", "index", "buffer" };
+  int k = rnd(100000);
+  return sprintf(s,
+    "// walk the list and add up %s\n"
+    "static %s fn_%d(struct node *n, int %s) {\n"
+    "  for (int i = 0; i < %s; i++) {\n"
+    "    if (n->%s[i] > LIMIT_%d) return -1;  /* bail out */\n"
+    "    while (n && n->next != NULL) n = n->next;\n"
+    "    total += n->%s[i] * %d + sizeof(struct node);\n"
+    "  }\n"
+    "  return (%s)total;\n"
+    "}\n\n",
+    names[rnd(6)], types[rnd(5)], k, names[rnd(6)], names[rnd(6)], names[rnd(6)], k % 97,
+    names[rnd(6)], k % 13, types[rnd(5)]);
+}
+
+static int gen_prose(char *s) {
+  static const char *words[] = { "the", "editor", "naïve", "café", "Grüße", "déjà", "vu", "日本語の", "文章",
+                                 "русский", "текст", "emoji", "🙂", "e\xcc\x81t\xc3\xa9", "façade", "über",
+                                 "한국어", "καλημέρα", "fin", "Ärger" };
+  int n = 0, w = 8 + rnd(12);
+  for (int i = 0; i < w; i++) n += sprintf(s + n, "%s%s", i ? " " : "", words[rnd(20)]);
+  return n + sprintf(s + n, ".\n");
+}
+
+static int gen_line(char *s) {  // minified JSON, never a newline
+  return sprintf(s, "{\"id\":%u,\"name\":\"item %u\",\"tags\":[\"a\",\"b\"],\"ok\":%s},",
+                 rnd(1 << 30), rnd(1000), rnd(2) ? "true" : "false");
+}
+
+static int gen_log(char *s) {
+  static const char *lvl[] = { "INFO", "INFO", "INFO", "WARN", "DEBUG", "ERROR" };
+  static const char *msg[] = { "request served", "cache miss", "retrying upstream", "slow query",
+                               "connection reset by peer", "config reloaded" };
+  return sprintf(s, "2026-10-19T%02u:%02u:%02u.%03uZ %-5s [worker-%u] %s req=%u took=%ums\n",
+                 rnd(24), rnd(60), rnd(60), rnd(1000), lvl[rnd(6)], rnd(32), msg[rnd(6)],
+                 rnd(1000000), rnd(5000));
+}
+
+static int (*generators[NCORPUS])(char *) = { gen_src, gen_prose, gen_line, gen_log };
+
+// write the corpus unless a file of that size is already there
+static int make_corpus(struct corpus *c, int (*gen)(char *), char *path) {
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size == c->size) return 1;
+  FILE *f = fopen(path, "w");
+  if (!f) return 0;
+  static char chunk[1 << 20];
+  rng = 88172645463325252ULL + c->size;
+  for (long left = c->size; left > 0; ) {
+    int n = 0;
+    while (n < (int)sizeof(chunk) - 512) n += gen(chunk + n);
+    if (n > left) n = left;
+    if (left == n && c != &corpora[LONGLINE]) chunk[n - 1] = '\n';
+    fwrite(chunk, 1, n, f);
+    left -= n;
+  }
+  return fclose(f) == 0;
+}
+
+// make buffer k the current one
+static char *use(int k, int **len) {
+  buffer_park(&bufs[cur_buf], views[cur_view].pos);
+  cur_buf = k;
+  buffer_enter(&bufs[k]);
+  *len = &bufs[k].len;
+  return bufs[k].text;
+}
+
+// kernels: return the number of operations done, add the bytes scanned
+// (drawn, for the draws)
+#if ZT_HIGHLIGHT
+static long k_keywords(char *buf, int *len, long *bytes) {  // as draw_line scans a row
+  const char *color, *word;
+  long hits = 0;
+  for (int i = 0, end = 0; i < *len; i++) {
+    if (i < end) continue;
+    int d = match_keyword(buf, i, *len, &color, &word);
+    hits += d > 0;
+    end = i + (d ? d : 1);
+  }
+  sink = hits;
+  *bytes += *len;
+  return *len;
+}
+#endif
+
+static long k_search(char *buf, int *len, long *bytes) {
+  sink = search(buf, *len, 0, "req=1000001 ");  // never there
+  *bytes += *len;
+  return *len;
+}
+
+static long k_utf8_charlen(char *buf, int *len, long *bytes) {
+  long chars = 0;
+  for (int i = 0; i < *len; chars++) i += utf8_charlen(buf[i]);
+  sink = chars;
+  *bytes += *len;
+  return chars;
+}
+
+static long k_utf8_cols(char *buf, int *len, long *bytes) {
+  long lines = 0, cols = 0;
+  for (int start = 0; start < *len; lines++) {
+    int end = line_end(buf, *len, start);
+    cols += utf8_cols(buf, start, end);
+    start = end + 1;
+  }
+  sink = cols;
+  *bytes += *len;
+  return lines;
+}
+
+static long k_move_vert(char *buf, int *len, long *bytes) {
+  long moves = 0;
+  int pos = 8, next;
+  while ((next = move_vert(buf, *len, pos, 1)) != pos) pos = next, moves++;
+  while ((next = move_vert(buf, *len, pos, -1)) != pos) pos = next, moves++;
+  *bytes += 2L * *len;
+  return moves;
+}
+
+static long k_line_start(char *buf, int *len, long *bytes) {
+  for (int i = 0; i < 8; i++) sink = line_start(buf, *len, *len - i);
+  *bytes += 8L * *len;
+  return 8;
+}
+
+static long k_draw_full(char *buf, int *len, long *bytes) {  // repaint every row
+  int frames = 0;
+  long from = drawn;
+  for (int pos = 0; pos < *len && frames < 200; frames++) {
+    screen_reset();
+    draw(buf, *len, pos);
+    for (int i = 0; i < term_rows; i++) pos = move_vert(buf, *len, pos, 1);
+  }
+  fflush(stdout);
+  *bytes += drawn - from;
+  return frames;
+}
+
+static long k_draw_scroll(char *buf, int *len, long *bytes) {  // one line down per frame
+  int pos = 0;
+  long from = drawn;
+  scroll = 0;
+  screen_reset();
+  for (int i = 0; i < 1000; i++) {
+    draw(buf, *len, pos);
+    pos = move_vert(buf, *len, pos, 1);
+  }
+  fflush(stdout);
+  *bytes += drawn - from;
+  return 1000;
+}
+
+static long k_draw_longline(char *buf, int *len, long *bytes) {
+  long from = drawn;
+  for (int i = 0; i < 4; i++) {
+    screen_reset();
+    draw(buf, *len, *len / 2 + i);
+  }
+  fflush(stdout);
+  *bytes += drawn - from;
+  return 4;
+}
+
+static long k_edit_undo(char *buf, int *len, long *bytes) {  // type 200 bytes mid-file, undo them
+  int pos = *len / 2;
+  for (int i = 0; i < 200; i++) {
+    record_change(pos + i, NULL, 0, "x", 1);
+    replace_text(buf, len, pos + i, 0, "x", 1);
+  }
+  while (undo(buf, len, &pos)) {}
+  *bytes += 400L * (*len / 2);
+  return 200;
+}
+
+static long k_goto(char *buf, int *len, long *bytes) {  // 90% down with no index, first frame
+  line_index_edit(buf, 0, 0, "", 0);  // cut back to the top
+  line_index_start(buf, *len);
+  screen_reset();
+  draw(buf, *len, goto_pos(buf, *len, "90%"));
+  *bytes += *len;
+  return 1;
+}
+
+struct kernel {
+  const char *name;
+  int corpus;
+  long (*run)(char *buf, int *len, long *bytes);
+  const char *op;
+} kernels[] = {
+#if ZT_HIGHLIGHT
+  { "match_keyword", C_SRC, k_keywords, "byte" },
+#endif
+  { "search", LOG, k_search, "byte" },
+  { "utf8_charlen", PROSE, k_utf8_charlen, "char" },
+  { "utf8_cols", PROSE, k_utf8_cols, "line" },
+  { "move_vert", C_SRC, k_move_vert, "move" },
+  { "line_start", LONGLINE, k_line_start, "call" },
+  { "draw_full", C_SRC, k_draw_full, "frame" },
+  { "draw_scroll", C_SRC, k_draw_scroll, "frame" },
+  { "draw_longline", LONGLINE, k_draw_longline, "frame" },
+  { "edit_undo", C_SRC, k_edit_undo, "edit" },
+  { "goto", LOG, k_goto, "jump" },
+};
+#define NKERNELS (int)(sizeof(kernels) / sizeof(*kernels))
+
+// seconds per run of k, the median of at least 5 runs and 1s
+static double measure(struct kernel *k, char *buf, int *len, long *ops, long *bytes) {
+  double times[100], spent = 0;
+  int runs = 0;
+  while (runs < 5 || (spent < 1 && runs < 100)) {
+    *bytes = 0;
+    double t = now();
+    *ops = k->run(buf, len, bytes);
+    t = now() - t;
+    spent += t;
+    times[runs++] = t;
+  }
+  qsort(times, runs, sizeof(*times), by_time);
+  return times[runs / 2];
+}
+
+// baseline: { "corpus file": size, ..., "name": ns_per_op, ... }, one
+// entry per line
+static double baseline_of(const char *path, const char *name) {
+  FILE *f = fopen(path, "r");
+  if (!f) return 0;
+  char line[256], key[64];
+  double v, found = 0;
+  while (!found && fgets(line, sizeof(line), f))
+    if (sscanf(line, " \"%63[^\"]\" : %lf", key, &v) == 2 && !strcmp(key, name)) found = v;
+  fclose(f);
+  return found;
+}
+
+int main(int argc, char *argv[]) {
+  const char *base = "bench.json";
+  double threshold = 60;
+  int save_base = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-m") && i + 1 < argc) corpora[LOG].size = atol(argv[++i]) << 20;
+    else if (!strcmp(argv[i], "-b") && i + 1 < argc) base = argv[++i];
+    else if (!strcmp(argv[i], "-t") && i + 1 < argc) threshold = atof(argv[++i]);
+    else if (!strcmp(argv[i], "-s")) save_base = 1;
+    else {
+      fprintf(stderr, "usage: %s [-m MB] [-b baseline.json] [-t percent] [-s]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  // keywords come from this tree's languages/, through a private HOME
+  const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char home[PATH_MAX], dir[PATH_MAX + 32], langs[PATH_MAX], path[PATH_MAX + 64];
+  snprintf(home, sizeof(home), "%s/zt-bench-home", tmp);
+  mkdir(home, 0700);
+  snprintf(dir, sizeof(dir), "%s/.config", home);
+  mkdir(dir, 0700);
+  snprintf(dir, sizeof(dir), "%s/.config/zt", home);
+  mkdir(dir, 0700);
+  snprintf(path, sizeof(path), "%s/languages", dir);
+  if (realpath("languages", langs)) {
+    unlink(path);
+    if (symlink(langs, path)) {}
+  }
+  setenv("HOME", home, 1);
+
+  for (int k = 0; k < NCORPUS; k++) {
+    snprintf(path, sizeof(path), "%s/%s", tmp, corpora[k].file);
+    fprintf(stderr, "corpus %s (%ld MB)\n", path, corpora[k].size >> 20);
+    if (!make_corpus(&corpora[k], generators[k], path) || !buffer_open(path)) {
+      fprintf(stderr, "%s: cannot write or open\n", path);
+      return 2;
+    }
+    corpora[k].buf = nbufs - 1;
+#if ZT_COMPLETE
+    words_wait(wx);  // the index builder would compete with the kernels
+#endif
+  }
+
+  // the null terminal: fd 1 is no tty, so draw() keeps the size set here
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (null_fd < 0 || dup2(null_fd, 1) < 0) return 2;
+  close(null_fd);
+  stdout = fopencookie(NULL, "w", (cookie_io_functions_t){ .write = null_write });
+  if (!stdout) return 2;
+  term_rows = 60;
+  term_cols = 200;
+
+  // times taken on corpora of another size say nothing about these
+  int same[NCORPUS];
+  for (int k = 0; k < NCORPUS; k++) {
+    double was = baseline_of(base, corpora[k].file);
+    same[k] = was == corpora[k].size;
+    if (same[k] || save_base || access(base, R_OK)) continue;
+    if (was > 0) fprintf(stderr, "%s has %s at %.0f MB, not %ld MB: its kernels are not compared\n",
+                         base, corpora[k].file, was / (1 << 20), corpora[k].size >> 20);
+    else fprintf(stderr, "%s has no size for %s: its kernels are not compared\n", base, corpora[k].file);
+  }
+
+  int regressions = 0;
+  FILE *out = save_base ? fopen(base, "w") : NULL;
+  if (out) {
+    fprintf(out, "{\n");
+    for (int k = 0; k < NCORPUS; k++) fprintf(out, "  \"%s\": %ld,\n", corpora[k].file, corpora[k].size);
+  }
+  fprintf(stderr, "\n%-14s %14s %-6s %8s %14s %8s\n", "kernel", "ns", "per", "MB/s", "baseline", "change");
+  for (int i = 0; i < NKERNELS; i++) {
+    struct kernel *k = &kernels[i];
+    int *len;
+    char *buf = use(corpora[k->corpus].buf, &len);
+    long ops = 0, bytes = 0;
+    double mid = measure(k, buf, len, &ops, &bytes), old = same[k->corpus] ? baseline_of(base, k->name) : 0;
+    // noise on a shared machine only makes a kernel look slower, so a
+    // slow one is measured again, and a baseline always is
+    for (int round = 1; round < (save_base ? 3 : 5) && (save_base || (old > 0 && mid * 1e9 / ops > old * (1 + threshold / 100))); round++) {
+      double again = measure(k, buf, len, &ops, &bytes);
+      if (again < mid) mid = again;
+    }
+    double ns = mid * 1e9 / ops;
+    double change = old > 0 ? (ns - old) * 100 / old : 0;
+    int slower = old > 0 && !save_base && change > threshold;
+    regressions += slower;
+    fprintf(stderr, "%-14s %14.2f %-6s", k->name, ns, k->op);
+    if (bytes) fprintf(stderr, " %8.0f", bytes / mid / 1e6);
+    else fprintf(stderr, " %8s", "-");
+    if (old > 0) fprintf(stderr, " %14.2f %+7.1f%%%s", old, change, slower ? "  REGRESSION" : "");
+    fprintf(stderr, "\n");
+    if (out) fprintf(out, "  \"%s\": %.3f%s\n", k->name, ns, i < NKERNELS - 1 ? "," : "");
+  }
+  if (out) {
+    fprintf(out, "}\n");
+    fclose(out);
+    fprintf(stderr, "baseline written to %s\n", base);
+  }
+  if (regressions) fprintf(stderr, "%d kernel(s) more than %.0f%% slower than %s\n", regressions, threshold, base);
+  return regressions > 0;
+}
@@ -1,3 +1,45 @@
+#define _GNU_SOURCE
+
+// build profiles: -DZT_PROFILE=tiny for rescue images, full (the default)
+// for everything. Each switch below can also be set on its own, e.g.
+// -DZT_PROFILE=tiny -DZT_HIGHLIGHT=1; what is off is not compiled at all
+#define tiny 1
+#define full 2
+#ifndef ZT_PROFILE
+#define ZT_PROFILE full
+#endif
+#if ZT_PROFILE == tiny
+#define ZT_ALL 0
+#elif ZT_PROFILE == full
+#define ZT_ALL 1
+#else
+#error "ZT_PROFILE must be tiny or full"
+#endif
+#undef tiny
+#undef full
+
+#ifndef ZT_THREADS
+#define ZT_THREADS ZT_ALL    // parallel load, sort and diff
+#endif
+#ifndef ZT_HIGHLIGHT
+#define ZT_HIGHLIGHT ZT_ALL  // syntax colors from ~/.config/zt/languages
+#endif
+#ifndef ZT_GUTTER
+#define ZT_GUTTER ZT_ALL     // diff gutter, diffed on a worker thread
+#endif
+#ifndef ZT_COMPLETE
+#define ZT_COMPLETE ZT_ALL   // word index and Ctrl+N completion
+#endif
+#ifndef ZT_TRACE
+#define ZT_TRACE ZT_ALL      // last edit shown on the status line
+#endif
+#ifndef ZT_HEADROOM          // address space reserved past the file for growth
+#define ZT_HEADROOM (ZT_ALL ? 1L << 30 : 64L << 20)
+#endif
+#if ZT_GUTTER && !ZT_THREADS
+#error "ZT_GUTTER needs ZT_THREADS"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -11,9 +53,24 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <dirent.h>
+#if ZT_THREADS
+#include <pthread.h>
+#endif
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
 
 #define BUF_SIZE     65536
-#define MAX_HISTORY   1024
+#ifndef MAX_HISTORY
+#define MAX_HISTORY   (ZT_ALL ? 1024 : 256)
+#endif
 
 #define KEY_UP        1000
 #define KEY_DOWN      1001
@@ -56,6 +113,30 @@
 #define CTRL_U        1029
 #define CTRL_K        1030
 
+#define KEY_INSERT    1031
+#define HEXMODE       1032
+#define UTF8_CHAR     1033
+#define CTRL_R        1034
+#define YANK          1035
+#define NEXTBUF       1036
+#define PREVBUF       1037
+#define SPLIT         1038
+#define VSPLIT        1039
+#define OTHERVIEW     1040
+#define LINEOPS       1041
+#define PIPE          1042
+#define RECORD        1043
+#define RUNMACRO      1044
+#define MACRO_DONE    1045
+#define MATCHBRACKET  1046
+#define ENCLOSING     1047
+#define FOLD          1048
+#define FOLDALL       1049
+#define NEXTCHANGE    1050
+#define WORKER_DONE   1051
+#define COMPLETE      1052
+#define GOTO          1053
+
 #define MOUSE_MOVE    1100
 #define DOUBLE_CLICK  1101
 #define TRIPLE_CLICK  1102
@@ -65,6 +146,7 @@ struct termios orig;
 char *filename = "no-name";
 int term_rows = 24, term_cols = 80;
 char status_msg[80] = "";
+unsigned long long status_hash = 0;  // of the status line on screen, 0 if unknown
 
 int scroll = 0;
 int hscroll = 0;
@@ -72,53 +154,1630 @@ int hscroll = 0;
 //mouse
 int mouse_x = 0,mouse_y=0;
 char mouse_b;
+int mouse_drag = 0;  // the last mouse report was a drag
+
+//typed multibyte character
+char utf8_input[4];
+int utf8_input_len = 0;
+
+//macro: decoded keys, with the character of UTF8_CHAR or the answer
+//of a key that prompts
+struct mkey { int ch; char *text; } *macro;
+int macro_len = 0, macro_cap = 0;
+int recording = 0, playing = 0;
+int play_at, play_count, play_runs, play_mode, play_rest, play_tail;
+struct timeval play_start;
 
 //selection
 int sel_anchor = -1;
 int sel_mode = 0;
 int sel_persistent = 0;
-char clipboard[BUF_SIZE];
+int overwrite = 0;
+
+//hex view
+int hex_mode = 0;
+int hex_nibble = 0;
+
+// text storage: one reserved mapping, pages are committed only when touched
+int buf_cap = BUF_SIZE;
+
+char *buf_alloc(long size) {
+  long cap = size + BUF_SIZE;
+  if (sizeof(long) > 4) cap = size + ZT_HEADROOM;
+  if (cap > INT_MAX) cap = INT_MAX;
+  if (size >= cap) return NULL;
+  char *p = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) return NULL;
+  buf_cap = cap;
+  return p;
+}
+
+// save state: what changed since the file was last read or written
+#define MAX_DIRTY 32
+long disk_len = -1;   // size of the file on disk, -1 if it does not exist
+int reshaped = 0;     // a length-changing edit hit the on-disk range
+struct range { int from, to; } dirty[MAX_DIRTY];
+int dirty_count = 0;
+
+void mark_dirty(int pos, int lenb, int lena) {
+  if (lenb != lena) {
+    if (pos < disk_len) reshaped = 1;
+    return;
+  }
+  int from = pos, to = pos + lena;
+  if (to > disk_len) to = disk_len;   // the tail past disk_len is always written
+  if (from >= to) return;
+
+  for (int i = 0; i < dirty_count; i++) {
+    if (from <= dirty[i].to && to >= dirty[i].from) {
+      if (from < dirty[i].from) dirty[i].from = from;
+      if (to > dirty[i].to) dirty[i].to = to;
+      return;
+    }
+  }
+  if (dirty_count == MAX_DIRTY) {     // too many islands: keep one extent
+    for (int i = 1; i < dirty_count; i++) {
+      if (dirty[i].from < dirty[0].from) dirty[0].from = dirty[i].from;
+      if (dirty[i].to > dirty[0].to) dirty[0].to = dirty[i].to;
+    }
+    dirty_count = 1;
+    if (from < dirty[0].from) dirty[0].from = from;
+    if (to > dirty[0].to) dirty[0].to = to;
+    return;
+  }
+  dirty[dirty_count].from = from;
+  dirty[dirty_count].to = to;
+  dirty_count++;
+}
+
+void mark_clean(int len) {
+  disk_len = len;
+  reshaped = 0;
+  dirty_count = 0;
+}
+
+#define MAX_THREADS 16
+
+#if ZT_THREADS
+int wake_pipe[2] = { -1, -1 };  // workers write here when a job is done
+
+int wake_open() {
+  return wake_pipe[0] >= 0 || !pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK);
+}
+#endif
+
+// line index: start offset of every LINE_STEP-th line, built lazily from
+// the top and cut back to the edit point whenever the text changes. Once
+// the line count is known, edits keep it up to date
+#define LINE_STEP 1024
+int *ckpt;
+int ckpt_count = 0, ckpt_cap = 0;
+int scan_pos = 0, scan_line = 0;  // how far the index has looked
+int total_lines = -1;             // -1 until known; the scan is done once
+                                  // scan_line + 1 reaches it
+
+// the k-th newline in [p, end), counting from 1, or NULL with k lowered by
+// the newlines there are; 64 bytes are counted at a time
+const char *newline_nth(const char *p, const char *end, int *k) {
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; end - p >= 64; p += 64) {
+    unsigned long long m = 0;
+    for (int i = 0; i < 4; i++)
+      m |= (unsigned long long)(unsigned)_mm_movemask_epi8(
+             _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), nl)) << (16 * i);
+    int n = __builtin_popcountll(m);
+    if (n < *k) {
+      *k -= n;
+      continue;
+    }
+    while (--*k) m &= m - 1;
+    return p + __builtin_ctzll(m);
+  }
+#endif
+  for (; p < end && (p = memchr(p, '\n', end - p)); p++)
+    if (!--*k) return p;
+  return NULL;
+}
+
+int count_lines(const char *buf, int from, int to) {
+  int k = INT_MAX;
+  newline_nth(buf + from, buf + to, &k);
+  return INT_MAX - k;
+}
+
+#if ZT_THREADS
+// the rest of the index can be built on a thread: one chunk per core
+// counts its newlines, then with the line it starts at known each chunk
+// records its checkpoints. Lookups take the result over once it is done;
+// edits and leaving the buffer wait for it
+struct line_chunk {
+  const char *buf;
+  int from, to, line, nl;
+  int *ck, k0;  // NULL while counting
+};
+
+struct line_job {
+  const char *buf;
+  int from, line, len;      // scan [from, len), from being the start of line
+  int *ck, n, last, total;  // checkpoints past line, start of the last line
+  pthread_t tid;
+  int running, done;        // done is set by the builder as it finishes
+} lx;
+
+// count the newlines of a chunk, or record its checkpoints on the way
+void *line_chunk(void *arg) {
+  struct line_chunk *c = arg;
+  if (!c->ck) {
+    c->nl = count_lines(c->buf, c->from, c->to);
+    return NULL;
+  }
+  const char *p = c->buf + c->from, *end = c->buf + c->to;
+  int line = c->line;
+  for (;;) {
+    int want = LINE_STEP - line % LINE_STEP, k = want;
+    const char *nl = newline_nth(p, end, &k);
+    line += want - k;
+    if (!nl) break;
+    c->ck[line / LINE_STEP - c->k0] = nl - c->buf + 1;
+    p = nl + 1;
+  }
+  c->nl = line - c->line;
+  return NULL;
+}
+
+// with one chunk the line it starts at is known, so counting is skipped
+void *line_builder(void *arg) {
+  struct line_chunk part[MAX_THREADS];
+  pthread_t tid[MAX_THREADS];
+  int t = sysconf(_SC_NPROCESSORS_ONLN), size = lx.len - lx.from, k0 = lx.line / LINE_STEP + 1;
+  if (t > MAX_THREADS) t = MAX_THREADS;
+  if (t < 1 || size < (4 << 20)) t = 1;
+
+  for (int i = 0; i < t; i++)
+    part[i] = (struct line_chunk){ lx.buf, lx.from + (int)((long)size * i / t),
+                                   lx.from + (int)((long)size * (i + 1) / t), lx.line, 0, NULL, k0 };
+  lx.ck = malloc((size / LINE_STEP + 1) * sizeof(int));  // a line is a byte at least
+  for (int pass = t == 1; pass < 2; pass++) {
+    int started[MAX_THREADS] = { 0 };
+    for (int i = 0; i < t; i++) {
+      if (i && pass) part[i].line = part[i - 1].line + part[i - 1].nl;
+      part[i].ck = pass ? lx.ck : NULL;
+    }
+    for (int i = 1; i < t; i++) started[i] = pthread_create(&tid[i], NULL, line_chunk, &part[i]) == 0;
+    for (int i = 0; i < t; i++)
+      if (!started[i]) line_chunk(&part[i]);
+    for (int i = 1; i < t; i++)
+      if (started[i]) pthread_join(tid[i], NULL);
+  }
+  int line = part[t - 1].line + part[t - 1].nl;
+  lx.total = line + 1;
+  lx.n = line / LINE_STEP - k0 + 1;
+  const char *nl = size > 0 ? memrchr(lx.buf + lx.from, '\n', size) : NULL;
+  lx.last = nl ? nl - lx.buf + 1 : lx.from;
+  __atomic_store_n(&lx.done, 1, __ATOMIC_RELEASE);
+  if (wake_pipe[1] >= 0 && write(wake_pipe[1], "", 1) < 0) {}
+  return arg;
+}
+
+void line_index_take() {
+  lx.running = 0;
+  int k0 = lx.line / LINE_STEP + 1;
+  if (k0 + lx.n > ckpt_cap) ckpt = realloc(ckpt, (ckpt_cap = k0 + lx.n) * sizeof(int));
+  memcpy(ckpt + k0, lx.ck, lx.n * sizeof(int));
+  ckpt_count = k0 + lx.n;
+  scan_pos = lx.last;
+  scan_line = lx.total - 1;
+  total_lines = lx.total;
+  free(lx.ck);
+  lx.ck = NULL;
+}
+#endif
+
+void line_index_wait() {
+#if ZT_THREADS
+  if (!lx.running) return;
+  pthread_join(lx.tid, NULL);
+  line_index_take();
+#endif
+}
+
+// take over what the builder found, if it is done
+void line_index_poll() {
+#if ZT_THREADS
+  if (lx.running && __atomic_load_n(&lx.done, __ATOMIC_ACQUIRE)) line_index_wait();
+#endif
+}
+
+// before buf[pos, pos + lenb) becomes after
+void line_index_edit(const char *buf, int pos, int lenb, const char *after, int lena) {
+  line_index_wait();
+  if (!ckpt) return;
+  if (total_lines >= 0) total_lines += count_lines(after, 0, lena) - count_lines(buf, pos, pos + lenb);
+  int lo = 1, hi = ckpt_count;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ckpt[mid] <= pos) lo = mid + 1;
+    else hi = mid;
+  }
+  ckpt_count = lo;
+  if (scan_pos > pos) {
+    scan_pos = ckpt[lo - 1];
+    scan_line = (lo - 1) * LINE_STEP;
+  }
+}
+
+// scan forward, a checkpoint at a time, until pos or line is covered (pass
+// -1 to ignore one of them)
+void line_index_extend(char *buf, int len, int pos, int line) {
+  if (!ckpt) {
+    ckpt = malloc(256 * sizeof(int));
+    ckpt_cap = 256;
+    ckpt[0] = 0;
+    ckpt_count = 1;
+  }
+  line_index_poll();
+#if ZT_THREADS
+  if (lx.running && ((pos >= 0 && pos - scan_pos > 4 << 20) || (line >= 0 && line - scan_line > 64 * LINE_STEP)))
+    line_index_wait();  // far ahead: the builder gets there sooner
+#endif
+  while (total_lines != scan_line + 1 && (pos < 0 || scan_pos <= pos) && (line < 0 || scan_line < line)) {
+    int want = LINE_STEP - scan_line % LINE_STEP, k = want;
+    const char *nl = newline_nth(buf + scan_pos, buf + len, &k);
+    scan_line += want - k;
+    if (!nl) {
+      nl = memrchr(buf + scan_pos, '\n', len - scan_pos);
+      if (nl) scan_pos = nl - buf + 1;
+      total_lines = scan_line + 1;
+      break;
+    }
+    scan_pos = nl - buf + 1;
+    if (ckpt_count == ckpt_cap) ckpt = realloc(ckpt, (ckpt_cap *= 2) * sizeof(int));
+    ckpt[ckpt_count++] = scan_pos;
+  }
+}
+
+// finish the index: on a thread when there is much left, else right here
+void line_index_start(char *buf, int len) {
+  line_index_extend(buf, len, 0, -1);
+  if (total_lines == scan_line + 1) return;
+#if ZT_THREADS
+  if (lx.running) return;
+  if (len - scan_pos >= 1 << 20) {
+    wake_open();
+    lx = (struct line_job){ .buf = buf, .from = scan_pos, .line = scan_line, .len = len };
+    lx.running = pthread_create(&lx.tid, NULL, line_builder, NULL) == 0;
+    if (lx.running) return;
+  }
+#endif
+  line_index_extend(buf, len, -1, INT_MAX);
+}
+
+// line number of byte offset pos
+int line_of(char *buf, int len, int pos) {
+  line_index_extend(buf, len, pos, -1);
+  int lo = 0, hi = ckpt_count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (ckpt[mid] <= pos) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo * LINE_STEP + count_lines(buf, ckpt[lo], pos);
+}
+
+// start offset of a line; past the last line it returns the last one
+int line_offset(char *buf, int len, int line) {
+  line_index_extend(buf, len, -1, line);
+  int k = line / LINE_STEP;
+  if (k >= ckpt_count) k = ckpt_count - 1;
+  int off = ckpt[k];
+  for (int n = k * LINE_STEP; n < line; n++) {
+    char *nl = memchr(buf + off, '\n', len - off);
+    if (!nl) break;
+    off = nl - buf + 1;
+  }
+  return off;
+}
+
+int line_start(char *buf, int len, int pos) {
+  char *nl = pos > 0 ? memrchr(buf, '\n', pos) : NULL;
+  return nl ? nl - buf + 1 : 0;
+}
+
+int line_end(char *buf, int len, int pos) {
+  char *nl = pos < len ? memchr(buf + pos, '\n', len - pos) : NULL;
+  return nl ? nl - buf : len;
+}
+
+// clipboard: reference-counted byte blobs. A copy starts as a live slice
+// of the text and only gets its own bytes when an edit would move them
+struct clip {
+  int refs, len;
+  const char *src;   // live slice of the text, NULL once materialized
+  char *data;
+  struct clip *next_live;
+};
+
+struct clip *live_clips;
+
+struct clip *clip_new(const char *s, int len, int live) {
+  struct clip *c = calloc(1, sizeof(*c));
+  if (!c) return NULL;
+  c->refs = 1;
+  c->len = len;
+  if (live) {
+    c->src = s;
+    c->next_live = live_clips;
+    live_clips = c;
+  } else if ((c->data = malloc(len + 1))) {
+    if (len && s) memcpy(c->data, s, len);  // no s: the caller fills data
+  } else {
+    c->len = 0;
+  }
+  return c;
+}
+
+struct clip *clip_ref(struct clip *c) {
+  if (c) c->refs++;
+  return c;
+}
+
+const char *clip_bytes(struct clip *c) {
+  return c->src ? c->src : c->data;
+}
+
+void clip_unlive(struct clip *c) {
+  for (struct clip **p = &live_clips; *p; p = &(*p)->next_live)
+    if (*p == c) {
+      *p = c->next_live;
+      break;
+    }
+  c->src = NULL;
+}
+
+void clip_unref(struct clip *c) {
+  if (!c || --c->refs > 0) return;
+  if (c->src) clip_unlive(c);
+  free(c->data);
+  free(c);
+}
+
+// called before buf changes at pos: copy out every slice that would move
+void clips_edit(char *buf, int pos) {
+  struct clip *c = live_clips;
+  while (c) {
+    struct clip *next = c->next_live;
+    if (c->src + c->len > buf + pos && c->src < buf + buf_cap) {  // only this buffer's text
+      c->data = malloc(c->len + 1);
+      if (c->data) memcpy(c->data, c->src, c->len);
+      else c->len = 0;
+      clip_unlive(c);
+    }
+    c = next;
+  }
+}
+
+// registers: 0 is the default one, 1..26 are a..z
+#define KILL_RING 8
+struct clip *reg[27];
+int cur_reg = 0;
+struct clip *kill_ring[KILL_RING];
+int kill_top = 0;
+
+void set_register(int r, struct clip *c) {
+  clip_unref(reg[r]);
+  reg[r] = c;
+}
+
+void kill_push(struct clip *c) {
+  kill_top = (kill_top + 1) % KILL_RING;
+  clip_unref(kill_ring[kill_top]);
+  kill_ring[kill_top] = c;
+}
+
+// OSC 52: hand the copy to the host terminal, base64 encoded in chunks
+void osc52_export(struct clip *c) {
+  static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  static int enabled = -1;
+  if (enabled < 0) enabled = getenv("ZT_OSC52") != NULL;
+  if (!enabled || !c) return;
+
+  const unsigned char *s = (const unsigned char *)clip_bytes(c);
+  char chunk[4096];
+  int n = 0;
+  printf("\033]52;c;");
+  for (int i = 0; i < c->len; i += 3) {
+    int v = s[i] << 16 | (i + 1 < c->len ? s[i + 1] << 8 : 0) | (i + 2 < c->len ? s[i + 2] : 0);
+    chunk[n++] = b64[v >> 18 & 63];
+    chunk[n++] = b64[v >> 12 & 63];
+    chunk[n++] = i + 1 < c->len ? b64[v >> 6 & 63] : '=';
+    chunk[n++] = i + 2 < c->len ? b64[v & 63] : '=';
+    if (n == sizeof(chunk)) {
+      fwrite(chunk, 1, n, stdout);
+      n = 0;
+    }
+  }
+  fwrite(chunk, 1, n, stdout);
+  printf("\a");
+  fflush(stdout);
+}
+
+// split windows: up to two views of the current buffer, each with its
+// own cursor and scroll. row_hash remembers what every screen row shows,
+// so a frame only sends the rows that changed in either view
+struct view {
+  int y, x, rows, cols;    // screen area, 1-based
+  int pos, scroll, hscroll;
+  int cy, cx;              // cursor on screen after the last frame
+  int *row_vis, *row_col;  // row map of the last frame
+  int rows_drawn;
+  unsigned long long *row_hash;
+  int top;                 // row of the file on the first row last frame, -1 unknown
+} views[2];
+int nviews = 1, cur_view = 0;
+int split = 0;  // 0 one view, 1 stacked, 2 side by side
+
+// keep the cursor of the other view on the same text
+void views_edit(int pos, int lenb, int lena) {
+  for (int k = 0; k < 2; k++) {
+    if (k == cur_view || views[k].pos <= pos) continue;
+    views[k].pos = views[k].pos >= pos + lenb ? views[k].pos - lenb + lena : pos;
+  }
+}
+
+// undo group: while a macro plays, edits are not recorded one by one.
+// The span they touch is tracked instead and recorded once at the end;
+// bytes outside [group_from, len - group_tail) are still the original
+// ones, so the span's original text is collected as it grows
+int grouping = 0;  // 1 started, 2 has edits, -1 out of memory
+int group_from, group_tail;
+char *group_mem;
+int group_head, group_end, group_cap;
+
+// add n original bytes before or after the collected ones
+void group_put(const char *s, int n, int front) {
+  int used = group_end - group_head;
+  if ((front ? group_head : group_cap - group_end) < n) {
+    int cap = (used + n) * 2 + 4096;
+    char *m = malloc(cap);
+    if (!m) { grouping = -1; return; }
+    int head = (cap - used - n) / 2 + (front ? n : 0);
+    if (used) memcpy(m + head, group_mem + group_head, used);
+    free(group_mem);
+    group_mem = m;
+    group_cap = cap;
+    group_head = head;
+    group_end = head + used;
+  }
+  if (front) memcpy(group_mem + (group_head -= n), s, n);
+  else memcpy(group_mem + group_end, s, n), group_end += n;
+}
+
+void group_edit(char *buf, int len, int pos, int lenb) {
+  int tail = len - pos - lenb;
+  if (grouping == 1) {
+    grouping = 2;
+    group_from = pos;
+    group_tail = tail;
+    group_put(buf + pos, lenb, 0);
+    return;
+  }
+  if (grouping != 2) return;
+  if (pos < group_from) {
+    group_put(buf + pos, group_from - pos, 1);
+    group_from = pos;
+  }
+  if (tail < group_tail) {
+    group_put(buf + len - group_tail, group_tail - tail, 0);
+    group_tail = tail;
+  }
+}
+
+// bracket index: every (){}[] outside strings and comments, sorted by
+// position. Block comments are kept as spans, so an edit rescans from its
+// line only until the comment state at a line start agrees with the old
+// index again. Positions past the last edit carry a pending shift that is
+// only applied as far as the next edit reaches, like a gap, so typing in
+// one place doesn't touch the whole index. Each bracket also keeps how
+// many are open after it, and a min tree over those depths finds a match
+// or the enclosing bracket with one descent
+#define LEX_SLASH  1  // // and /* */ comments
+#define LEX_HASH   2  // # comments
+#define LEX_QUOTES 4  // "..." and '...' on one line
+
+struct bracket { int pos; char c; int depth; };  // depth: left open after it
+struct span { int from, to; };
+struct brackets {
+  struct bracket *b;
+  int n, cap;
+  int at, d, dd;       // b[at..] are off by d, their depths by dd
+  int *t, tn;          // min tree over the stored depths, tn leaves
+  struct span *cmt;    // block comments, [from, to) after the */, INT_MAX if open
+  int ncmt, cmt_cap;
+  int cat, cd;         // the same for cmt
+  int lex, built;
+} bx;
+
+static unsigned char brk_special[256];  // bytes that can change the index
+
+void brk_push(struct bracket **b, int *n, int *cap, int pos, char c) {
+  if (*n == *cap) *b = realloc(*b, (*cap = *cap * 2 + 256) * sizeof(**b));
+  (*b)[(*n)++] = (struct bracket){ pos, c, 0 };
+}
+
+char brk_opener(char c) { return c == ')' ? '(' : c == ']' ? '[' : c == '}' ? '{' : 0; }
+char brk_closer(char c) { return c == '(' ? ')' : c == '[' ? ']' : c == '{' ? '}' : 0; }
+
+// depths of b[0..n) after one that left h open
+void brk_depths(struct bracket *b, int n, int h) {
+  for (int i = 0; i < n; i++) b[i].depth = h += brk_closer(b[i].c) ? 1 : -1;
+}
+
+// refresh the tree over b[lo..hi), leaves past n empty; it is regrown
+// from scratch when n outgrows it
+void brk_fix(int lo, int hi) {
+  if (!bx.t || bx.n > bx.tn) {
+    free(bx.t);
+    for (bx.tn = 256; bx.tn < bx.n; bx.tn *= 2);
+    bx.t = malloc(2 * bx.tn * sizeof(*bx.t));
+    lo = 0;
+    hi = bx.tn;
+  }
+  if (hi > bx.tn) hi = bx.tn;
+  if (lo >= hi) return;
+  for (int i = lo; i < hi; i++) bx.t[bx.tn + i] = i < bx.n ? bx.b[i].depth : INT_MAX;
+  for (lo += bx.tn, hi += bx.tn - 1; lo > 1; lo /= 2, hi /= 2)
+    for (int p = lo / 2; p <= hi / 2; p++)
+      bx.t[p] = bx.t[2 * p] < bx.t[2 * p + 1] ? bx.t[2 * p] : bx.t[2 * p + 1];
+}
+
+void span_push(struct span **s, int *n, int *cap, int from, int to) {
+  if (*n == *cap) *s = realloc(*s, (*cap = *cap * 2 + 16) * sizeof(**s));
+  (*s)[(*n)++] = (struct span){ from, to };
+}
+
+int brk_pos(int i) { return bx.b[i].pos + (i >= bx.at ? bx.d : 0); }
+int brk_depth(int i) { return bx.b[i].depth + (i >= bx.at ? bx.dd : 0); }
+int cmt_from(int i) { return bx.cmt[i].from + (i >= bx.cat ? bx.cd : 0); }
+int cmt_to(int i) { int t = bx.cmt[i].to; return i < bx.cat || t == INT_MAX ? t : t + bx.cd; }
+
+// apply the pending shift up to index k, so it only covers k..
+void brk_settle(int k) {
+  int lo = bx.at < k ? bx.at : k, hi = bx.at < k ? k : bx.at;
+  if (bx.d || bx.dd) {
+    for (; bx.at < k; bx.at++) {
+      bx.b[bx.at].pos += bx.d;
+      bx.b[bx.at].depth += bx.dd;
+    }
+    for (; bx.at > k; bx.at--) {
+      bx.b[bx.at - 1].pos -= bx.d;
+      bx.b[bx.at - 1].depth -= bx.dd;
+    }
+    if (bx.dd) brk_fix(lo, hi);
+  }
+  bx.at = k;
+}
+
+void cmt_settle(int k) {
+  if (bx.cd) {
+    for (; bx.cat < k; bx.cat++) {
+      bx.cmt[bx.cat].from += bx.cd;
+      if (bx.cmt[bx.cat].to != INT_MAX) bx.cmt[bx.cat].to += bx.cd;
+    }
+    for (; bx.cat > k; bx.cat--) {
+      bx.cmt[bx.cat - 1].from -= bx.cd;
+      if (bx.cmt[bx.cat - 1].to != INT_MAX) bx.cmt[bx.cat - 1].to -= bx.cd;
+    }
+  }
+  bx.cat = k;
+}
+
+// first bracket at or after pos
+int brk_find(int pos) {
+  int lo = 0, hi = bx.n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (brk_pos(mid) < pos) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// first comment starting at or after pos
+int span_find(int pos) {
+  int lo = 0, hi = bx.ncmt;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cmt_from(mid) < pos) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// the comment span with from < pos < to, -1 if none
+int span_at(int pos) {
+  int k = span_find(pos);
+  return k > 0 && cmt_to(k - 1) > pos ? k - 1 : -1;
+}
+
+// scan buf from the line start 'from' (inside a comment that began at
+// cmt_open if that is >= 0) into nb/ns; stops at the first line start
+// after 'past' whose comment state matches the old index, and returns
+// that position (len at the end)
+int brk_scan(char *buf, int len, int from, int past, int cmt_open,
+             struct bracket **nb, int *n, int *cap, struct span **ns, int *nn, int *ncap) {
+  int i = from, lex = bx.lex;
+  while (i < len) {
+    char *nl = memchr(buf + i, '\n', len - i);
+    int le = nl ? nl - buf : len;
+    while (i < le) {
+      if (cmt_open >= 0) {
+        char *e = memmem(buf + i, le - i, "*/", 2);
+        if (!e) { i = le; break; }
+        i = e - buf + 2;
+        span_push(ns, nn, ncap, cmt_open, i);
+        cmt_open = -1;
+        continue;
+      }
+      unsigned char c = buf[i];
+      if (!brk_special[c]) { i++; continue; }
+      if (c == '(' || c == ')' || c == '[' || c == ']' || c == '{' || c == '}') {
+        brk_push(nb, n, cap, i, c);
+        i++;
+      } else if ((lex & LEX_QUOTES) && (c == '"' || c == '\'')) {
+        for (i++; i < le && buf[i] != c; i++)
+          if (buf[i] == '\\') i++;
+        i++;
+      } else if (((lex & LEX_HASH) && c == '#') || ((lex & LEX_SLASH) && c == '/' && i + 1 < le && buf[i + 1] == '/')) {
+        i = le;
+      } else if ((lex & LEX_SLASH) && c == '/' && i + 1 < le && buf[i + 1] == '*') {
+        cmt_open = i;
+        i += 2;
+      } else {
+        i++;
+      }
+    }
+    if (!nl) break;
+    i = le + 1;
+    if (i > past && (cmt_open >= 0) == (span_at(i) >= 0)) {  // its newline is old text
+      if (cmt_open >= 0) span_push(ns, nn, ncap, cmt_open, INT_MAX);  // the caller ends it
+      return i;
+    }
+  }
+  if (cmt_open >= 0) span_push(ns, nn, ncap, cmt_open, INT_MAX);  // never closed
+  return len;
+}
+
+void brk_build(char *buf, int len) {
+  if (bx.built) return;
+  const char *set = "()[]{}\"'/#*\\\n";
+  memset(brk_special, 0, sizeof(brk_special));
+  for (const char *s = set; *s; s++) brk_special[(unsigned char)*s] = 1;
+  bx.n = bx.ncmt = 0;
+  bx.at = bx.d = bx.dd = bx.cat = bx.cd = 0;
+  brk_scan(buf, len, 0, INT_MAX, -1, &bx.b, &bx.n, &bx.cap, &bx.cmt, &bx.ncmt, &bx.cmt_cap);
+  brk_depths(bx.b, bx.n, 0);
+  brk_fix(0, bx.tn);
+  bx.built = 1;
+}
+
+// before an edit: could it add, remove or hide a bracket, quote or comment?
+int brk_touched(char *buf, int len, int pos, int lenb, const char *after, int lena) {
+  if (!bx.built) return 0;
+  for (int i = 0; i < lenb; i++) if (brk_special[(unsigned char)buf[pos + i]]) return 1;
+  for (int i = 0; i < lena; i++) if (brk_special[(unsigned char)after[i]]) return 1;
+  return (pos > 0 && brk_special[(unsigned char)buf[pos - 1]]) ||
+         (pos + lenb < len && brk_special[(unsigned char)buf[pos + lenb]]);
+}
+
+// after an edit: shift what follows it, and rescan the edited lines
+// when brk_touched said so
+void brk_edit(char *buf, int len, int pos, int lenb, int lena, int touched) {
+  if (!bx.built) return;
+  int delta = lena - lenb, end = pos + lenb;
+  char *nl = pos > 0 ? memrchr(buf, '\n', pos) : NULL;
+  int from = nl ? nl - buf + 1 : 0;  // the edited line, unchanged before pos
+  int s = span_at(from), open = s >= 0 ? cmt_from(s) : -1;
+
+  int n0 = bx.n, k = brk_find(pos), k2 = brk_find(end);
+  brk_settle(k2);
+  int gone = k2 > k ? brk_depth(k2 - 1) - (k ? brk_depth(k - 1) : 0) : 0;
+  if (k2 > k) memmove(bx.b + k, bx.b + k2, (bx.n - k2) * sizeof(*bx.b));  // deleted ones
+  bx.n -= k2 - k;
+  bx.at = k;
+  bx.d += delta;
+  bx.dd -= gone;
+
+  // comments overlapping the edit are cut back to it, later ones shift
+  int c0 = span_find(pos), c1 = span_find(end);
+  if (c0 > 0 && cmt_to(c0 - 1) > pos) c0--;
+  cmt_settle(c1);
+  for (int i = c0; i < c1; i++) {
+    struct span *c = &bx.cmt[i];
+    if (c->from > pos) c->from = pos;
+    if (c->to != INT_MAX) c->to = c->to >= end ? c->to + delta : c->to > pos ? pos : c->to;
+  }
+  bx.cd += delta;
+  if (!touched) {
+    brk_fix(k, k2 > k ? n0 : k);  // the ones after the deleted moved down
+    return;
+  }
+
+  // rescan from the start of the edited line
+  struct bracket *nb = NULL;
+  struct span *ns = NULL;
+  int n = 0, cap = 0, nn = 0, ncap = 0;
+  int stop = brk_scan(buf, len, from, pos + lena, open, &nb, &n, &cap, &ns, &nn, &ncap);
+
+  // a comment still open at stop continues with the old span there
+  int cont = stop < len ? span_at(stop) : -1;
+  if (cont >= 0 && nn > 0 && ns[nn - 1].to == INT_MAX) ns[nn - 1].to = cmt_to(cont);
+
+  // splice brackets in [from, stop); what follows is as deep as before
+  // plus what the new ones leave open more than the old
+  int a = brk_find(from), b = brk_find(stop);
+  brk_settle(b);
+  int h = a ? brk_depth(a - 1) : 0, was = b > a ? brk_depth(b - 1) - h : 0;
+  brk_depths(nb, n, h);
+  int total = bx.n - (b - a) + n;
+  if (total > bx.cap) bx.b = realloc(bx.b, (bx.cap = total + 256) * sizeof(*bx.b));
+  memmove(bx.b + a + n, bx.b + b, (bx.n - b) * sizeof(*bx.b));
+  memcpy(bx.b + a, nb, n * sizeof(*nb));
+  bx.n = total;
+  bx.at = a + n;
+  bx.dd += (n ? nb[n - 1].depth - h : 0) - was;
+  brk_fix(a, k2 > k || n != b - a ? (n0 > total ? n0 : total) : a + n);  // moved ones too
+
+  // splice comments: keep those starting before from, except the one the
+  // scan carried on, and those starting at or after stop
+  int ca = s >= 0 ? s : span_find(from);
+  int cb = stop == len ? bx.ncmt : span_find(stop);
+  if (cb < ca) cb = ca;
+  cmt_settle(cb);
+  int ctotal = bx.ncmt - (cb - ca) + nn;
+  if (ctotal > bx.cmt_cap) bx.cmt = realloc(bx.cmt, (bx.cmt_cap = ctotal + 16) * sizeof(*bx.cmt));
+  memmove(bx.cmt + ca + nn, bx.cmt + cb, (bx.ncmt - cb) * sizeof(*bx.cmt));
+  memcpy(bx.cmt + ca, ns, nn * sizeof(*ns));
+  bx.ncmt = ctotal;
+  bx.cat = ca + nn;
+
+  free(nb);
+  free(ns);
+}
+
+// the bracket under or just before the cursor, -1 if none
+int brk_at(char *buf, int len, int pos) {
+  if (!bx.built) brk_build(buf, len);
+  int k = brk_find(pos);
+  if (k < bx.n && brk_pos(k) == pos) return k;
+  if (k > 0 && brk_pos(k - 1) == pos - 1) return k - 1;
+  return -1;
+}
+
+// first (or last, dir < 0) bracket in [lo, hi) left less deep than v,
+// -1 if none: a descent of the tree, through the nodes whose minimum is
+// below v, on each side of the pending shift
+int brk_first(int node, int nl, int nr, int lo, int hi, int v) {
+  if (nr <= lo || hi <= nl || bx.t[node] >= v) return -1;
+  if (nr - nl == 1) return nl;
+  int mid = (nl + nr) / 2, r = brk_first(2 * node, nl, mid, lo, hi, v);
+  return r >= 0 ? r : brk_first(2 * node + 1, mid, nr, lo, hi, v);
+}
+
+int brk_last(int node, int nl, int nr, int lo, int hi, int v) {
+  if (nr <= lo || hi <= nl || bx.t[node] >= v) return -1;
+  if (nr - nl == 1) return nl;
+  int mid = (nl + nr) / 2, r = brk_last(2 * node + 1, mid, nr, lo, hi, v);
+  return r >= 0 ? r : brk_last(2 * node, nl, mid, lo, hi, v);
+}
+
+int brk_below(int lo, int hi, int v, int dir) {
+  int m = bx.at < lo ? lo : bx.at > hi ? hi : bx.at, r;  // [m, hi) are off by dd
+  if (dir > 0) {
+    r = brk_first(1, 0, bx.tn, lo, m, v);
+    return r >= 0 ? r : brk_first(1, 0, bx.tn, m, hi, v - bx.dd);
+  }
+  r = brk_last(1, 0, bx.tn, m, hi, v - bx.dd);
+  return r >= 0 ? r : brk_last(1, 0, bx.tn, lo, m, v);
+}
+
+// the bracket matching k, -1 if none or of another kind: for an opener
+// the first one after it back to the depth before it, for a closer the
+// one after the last before it as deep as it leaves
+int brk_match(int k) {
+  char c = bx.b[k].c;
+  int h = brk_depth(k), r;
+  if (brk_closer(c)) {
+    r = brk_below(k + 1, bx.n, h, 1);
+    return r >= 0 && bx.b[r].c == brk_closer(c) ? r : -1;
+  }
+  r = brk_below(0, k, h + 1, -1) + 1;  // 0 if none, as if the file began at depth 0
+  if (!r && h < 0) return -1;
+  return r < k && bx.b[r].c == brk_opener(c) ? r : -1;
+}
+
+// the innermost open bracket around pos, -1 at the top level
+int brk_enclosing(char *buf, int len, int pos) {
+  if (!bx.built) brk_build(buf, len);
+  int k = brk_find(pos), h = k ? brk_depth(k - 1) : 0;
+  int r = brk_below(0, k, h, -1) + 1;  // after the last one less deep than pos
+  return r < k && (r || h > 0) ? r : -1;
+}
+
+// folds: line ranges [from, to] whose lines from+1..to can be hidden
+// under the header line from. They are kept sorted by from and nest like
+// a tree; the closed ones are flattened into disjoint hidden ranges with
+// a running count, so mapping between lines and screen rows is a binary
+// search however much is folded away
+struct fold { int from, to; char closed; };
+struct hidden { int from, to, before; };  // lines [from, to], before = hidden above
+struct folds {
+  struct fold *f;
+  int n, cap;
+  struct hidden *h;
+  int nh, hcap;
+} fx;
+
+void fold_flatten() {
+  fx.nh = 0;
+  for (int i = 0; i < fx.n; i++) {
+    if (!fx.f[i].closed) continue;
+    int from = fx.f[i].from + 1, to = fx.f[i].to;
+    if (fx.nh && from <= fx.h[fx.nh - 1].to + 1) {  // inside or right after the last one
+      if (to > fx.h[fx.nh - 1].to) fx.h[fx.nh - 1].to = to;
+      continue;
+    }
+    if (fx.nh == fx.hcap) fx.h = realloc(fx.h, (fx.hcap = fx.hcap * 2 + 16) * sizeof(*fx.h));
+    int before = fx.nh ? fx.h[fx.nh - 1].before + fx.h[fx.nh - 1].to - fx.h[fx.nh - 1].from + 1 : 0;
+    fx.h[fx.nh++] = (struct hidden){ from, to, before };
+  }
+}
+
+// number of hidden ranges starting at or before line
+int fold_count(int line) {
+  int lo = 0, hi = fx.nh;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (fx.h[mid].from <= line) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// the hidden range holding line, -1 if it is shown
+int fold_hidden(int line) {
+  int k = fold_count(line);
+  return k > 0 && line <= fx.h[k - 1].to ? k - 1 : -1;
+}
+
+// screen row of line counting from the top of the file; a hidden line
+// gets the row of its header
+int fold_row(int line) {
+  int k = fold_count(line);
+  if (k == 0) return line;
+  struct hidden *h = &fx.h[k - 1];
+  if (line <= h->to) return h->from - 1 - h->before;
+  return line - h->before - (h->to - h->from + 1);
+}
+
+// the line shown on a row, the inverse of fold_row
+int fold_line(int row) {
+  int lo = 0, hi = fx.nh;
+  while (lo < hi) {  // ranges whose lines come back at or before row
+    int mid = (lo + hi) / 2;
+    if (fx.h[mid].from - fx.h[mid].before <= row) lo = mid + 1;
+    else hi = mid;
+  }
+  if (lo == 0) return row;
+  struct hidden *h = &fx.h[lo - 1];
+  return row + h->before + (h->to - h->from + 1);
+}
+
+int indent_of(char *buf, int len, int start) {
+  int n = 0;
+  for (int i = start; i < len && (buf[i] == ' ' || buf[i] == '\t'); i++)
+    n = buf[i] == '\t' ? (n / 8 + 1) * 8 : n + 1;
+  return n;
+}
+
+int blank_line(char *buf, int len, int start) {
+  int i = start;
+  while (i < len && (buf[i] == ' ' || buf[i] == '\t' || buf[i] == '\r')) i++;
+  return i >= len || buf[i] == '\n';
+}
+
+// last line of the block headed by line (starting at start), or line
+// itself if there is none: up to the line before the closer of the first
+// bracket opened on it and closed further down, else the deeper indented
+// lines that follow it. *next gets the offset after the block
+int fold_extent(char *buf, int len, int line, int start, int *next) {
+  int end = line_end(buf, len, start);
+  *next = end + 1;
+  if (blank_line(buf, len, start)) return line;
+  if (bx.lex & LEX_SLASH) {
+    if (!bx.built) brk_build(buf, len);
+    for (int k = brk_find(start); k < bx.n && brk_pos(k) < end; k++) {
+      if (!brk_closer(bx.b[k].c)) continue;
+      int m = brk_match(k);
+      if (m >= 0 && brk_pos(m) > end) {
+        int close = line_start(buf, len, brk_pos(m));
+        if (close == end + 1) break;  // closed on the next line
+        *next = close;
+        return line + count_lines(buf, end, close) - 1;
+      }
+    }
+  }
+  int ind = indent_of(buf, len, start), last = line;
+  for (int l = line + 1, s = end + 1; s <= len; l++) {
+    int e = line_end(buf, len, s);
+    if (!blank_line(buf, len, s)) {
+      if (indent_of(buf, len, s) <= ind) break;
+      last = l;
+      *next = e + 1;
+    }
+    s = e + 1;
+  }
+  return last;
+}
+
+void fold_add(int from, int to) {
+  int lo = 0, hi = fx.n;  // after those starting earlier, or at from and longer
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (fx.f[mid].from < from || (fx.f[mid].from == from && fx.f[mid].to > to)) lo = mid + 1;
+    else hi = mid;
+  }
+  int k = lo;
+  if (fx.n == fx.cap) fx.f = realloc(fx.f, (fx.cap = fx.cap * 2 + 16) * sizeof(*fx.f));
+  memmove(fx.f + k + 1, fx.f + k, (fx.n - k) * sizeof(*fx.f));
+  fx.f[k] = (struct fold){ from, to, 1 };
+  fx.n++;
+}
+
+// fold or unfold at the cursor: the fold headed by its line, a new one
+// if the line heads a block, else the innermost open fold around it.
+// Returns the new cursor position
+int fold_toggle(char *buf, int len, int pos) {
+  int line = line_of(buf, len, pos), inner = -1;
+  for (int k = 0; k < fx.n; k++) {
+    if (fx.f[k].from == line) {
+      fx.f[k].closed ^= 1;
+      fold_flatten();
+      return pos;
+    }
+    if (fx.f[k].from < line && line <= fx.f[k].to && !fx.f[k].closed) inner = k;
+  }
+  int next, to = fold_extent(buf, len, line, line_start(buf, len, pos), &next);
+  if (to > line) {
+    fold_add(line, to);
+  } else if (inner >= 0) {
+    fx.f[inner].closed = 1;
+    pos = line_offset(buf, len, fx.f[inner].from);
+  } else {
+    snprintf(status_msg, sizeof(status_msg), "nothing to fold here");
+    return pos;
+  }
+  fold_flatten();
+  return pos;
+}
+
+// unfold everything, or if nothing is folded, fold every block that
+// starts at the left margin
+void fold_all(char *buf, int len) {
+  int any = 0;
+  for (int k = 0; k < fx.n; k++) any |= fx.f[k].closed;
+  if (any) {
+    for (int k = 0; k < fx.n; k++) fx.f[k].closed = 0;
+  } else {
+    fx.n = 0;
+    for (int l = 0, s = 0; s <= len; l++) {
+      int next, to = l;
+      if (!blank_line(buf, len, s) && buf[s] != ' ' && buf[s] != '\t')
+        to = fold_extent(buf, len, l, s, &next);
+      if (to > l) {
+        fold_add(l, to);
+        l = to;
+        s = next;
+      } else {
+        s = line_end(buf, len, s) + 1;
+      }
+    }
+  }
+  fold_flatten();
+}
+
+// open whatever hides line
+void fold_reveal(int line) {
+  if (fold_hidden(line) < 0) return;
+  for (int k = 0; k < fx.n; k++)
+    if (fx.f[k].from < line && line <= fx.f[k].to) fx.f[k].closed = 0;
+  fold_flatten();
+}
+
+// before an edit: move the folds with the lines, dropping the ones whose
+// lines are gone
+void folds_edit(char *buf, int len, int pos, int lenb, const char *after, int lena) {
+  if (!fx.n) return;
+  int nb = count_lines(buf, pos, pos + lenb), na = count_lines(after, 0, lena);
+  if (!nb && !na) return;
+  int line = line_of(buf, len, pos), n = 0;
+  if (!nb && pos == line_start(buf, len, pos)) line--;  // lines pushed in front of it move it down
+  for (int k = 0; k < fx.n; k++) {
+    struct fold f = fx.f[k];
+    f.from = f.from <= line ? f.from : f.from > line + nb ? f.from + na - nb : line + na;
+    f.to = f.to <= line ? f.to : f.to > line + nb ? f.to + na - nb : line + na;
+    if (f.to > f.from) fx.f[n++] = f;
+  }
+  fx.n = n;
+  fold_flatten();
+}
+
+#if ZT_GUTTER
+// diff gutter: every line is hashed, and the hashes of the text as it was
+// loaded or last saved are the baseline. Edits keep the current hashes
+// and the old line each current line matches up to date, and mark the
+// lines they touched. A worker thread then runs Myers only over the
+// touched lines widened to the nearest matched ones, and the result is
+// patched in on the next frame
+#define DIFF_MAX_D 2048  // beyond that a region just shows as changed
+#define DIFF_CONTEXT 8   // matched lines around an edit that may be rematched
+
+struct gutter {
+  unsigned long long *oh;  // baseline line hashes
+  int on;
+  unsigned long long *ch;  // current line hashes
+  int *cm;                 // old line matched by each current line, -1 if none
+  char *mk;                // '+' added, '~' changed, '-' lines deleted above
+  int cn, cap;
+  int da, db;              // current lines still to diff, da < 0 if none
+  int gen;
+} gx;
+
+int diff_gen = 0;  // bumped by every edit of any buffer
+
+struct diff_job {
+  unsigned long long *o, *c;  // copies of the old and current region
+  int on, cn, ocap, ccap;
+  int *m;                     // result: index in o matched by each of c
+  char *mk;
+  char tail;                  // mark for the matched line after the region
+  int oa, ca, gen;
+  char *text;                 // which buffer
+  int state;                  // 0 idle, 1 queued, 2 done
+} job;
+
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+unsigned long long line_hash(const char *s, int n) {
+  unsigned long long h = 0x9e3779b97f4a7c15ULL ^ n, w;
+  for (; n >= 8; s += 8, n -= 8) {
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  while (n-- > 0) h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+  return h ^ (h >> 29);
+}
+
+// Myers over a[0, n) and b[0, m): m_out[j] gets the a index matched by
+// b[j] or -1. Returns 0 if the edit script is longer than DIFF_MAX_D
+int myers(unsigned long long *a, int n, unsigned long long *b, int m, int *m_out) {
+  int pre = 0, suf = 0;
+  for (int j = 0; j < m; j++) m_out[j] = -1;
+  while (pre < n && pre < m && a[pre] == b[pre]) { m_out[pre] = pre; pre++; }
+  while (suf < n - pre && suf < m - pre && a[n - 1 - suf] == b[m - 1 - suf]) {
+    m_out[m - 1 - suf] = n - 1 - suf;
+    suf++;
+  }
+  a += pre; b += pre; m_out += pre;
+  n -= pre + suf; m -= pre + suf;
+  if (!n || !m) return 1;
+
+  int max = n + m < DIFF_MAX_D ? n + m : DIFF_MAX_D;
+  int *vs = malloc((2 * max + 3) * sizeof(int)), *v = vs + max + 1;  // v[k], k in [-d-1, d+1]
+  int **trace = malloc((max + 1) * sizeof(int *)), d, found = 0;
+  v[1] = 0;
+  for (d = 0; d <= max && !found; d++) {
+    for (int k = -d; k <= d; k += 2) {
+      int x = k == -d || (k != d && v[k - 1] < v[k + 1]) ? v[k + 1] : v[k - 1] + 1, y = x - k;
+      while (x < n && y < m && a[x] == b[y]) x++, y++;
+      v[k] = x;
+      if (x >= n && y >= m) found = 1;
+    }
+    trace[d] = malloc((2 * d + 1) * sizeof(int));  // v[-d..d] after round d
+    memcpy(trace[d], v - d, (2 * d + 1) * sizeof(int));
+  }
+  if (found) {  // walk back through the rounds, matching along the snakes
+    int x = n, y = m;
+    for (int e = d - 1; e >= 0; e--) {
+      int k = x - y, px, pk;
+      if (e == 0) {
+        px = pk = 0;
+      } else {
+        int *u = trace[e - 1] + (e - 1);
+        pk = k == -e || (k != e && u[k - 1] < u[k + 1]) ? k + 1 : k - 1;
+        px = u[pk];
+      }
+      int sx = e == 0 ? 0 : pk == k + 1 ? px : px + 1;  // where the snake began
+      while (x > sx && y > sx - k) m_out[--y] = --x + pre;
+      x = px;
+      y = px - pk;
+    }
+  }
+  for (int e = 0; e < d; e++) free(trace[e]);
+  free(trace);
+  free(vs);
+  return found;
+}
+
+void *diff_worker(void *arg) {
+  pthread_mutex_lock(&job_lock);
+  for (;;) {
+    while (job.state != 1) pthread_cond_wait(&job_cond, &job_lock);
+    pthread_mutex_unlock(&job_lock);
+
+    int *m = job.m;
+    if (!myers(job.o, job.on, job.c, job.cn, m))
+      for (int j = 0; j < job.cn; j++) m[j] = -1;
+    // marks: a run of unmatched lines is added, or changed if old lines
+    // went with it; old lines gone with nothing in their place mark the
+    // line after them
+    int prev = -1;  // o index of the last match
+    for (int j = 0; j <= job.cn; j++) {
+      if (j < job.cn && m[j] < 0) continue;
+      int next = j < job.cn ? m[j] : job.on, run = j;
+      while (run > 0 && m[run - 1] < 0) run--;
+      int dels = next - prev - 1;
+      for (int i = run; i < j; i++) job.mk[i] = dels ? '~' : '+';
+      char mark = run == j && dels ? '-' : 0;
+      if (j < job.cn) job.mk[j] = mark;
+      else job.tail = mark;
+      if (j < job.cn) prev = m[j];
+    }
+
+    pthread_mutex_lock(&job_lock);
+    job.state = 2;
+    if (write(wake_pipe[1], "", 1) < 0) {}
+  }
+  return arg;
+}
+
+void gutter_free() {
+  free(gx.oh); free(gx.ch); free(gx.cm); free(gx.mk);
+  memset(&gx, 0, sizeof(gx));
+}
+
+void gutter_grow(int n) {
+  if (n <= gx.cap) return;
+  gx.cap = n + n / 2 + 64;
+  gx.ch = realloc(gx.ch, gx.cap * sizeof(*gx.ch));
+  gx.cm = realloc(gx.cm, gx.cap * sizeof(*gx.cm));
+  gx.mk = realloc(gx.mk, gx.cap);
+}
+
+// the current text becomes the baseline: on the first edit, and on save
+void gutter_rebase(char *buf, int len) {
+  if (!gx.ch) {
+    int n = count_lines(buf, 0, len) + 1, l = 0;
+    gutter_grow(n);
+    for (int s = 0; s <= len; l++) {
+      int e = line_end(buf, len, s);
+      gx.ch[l] = line_hash(buf + s, e - s);
+      s = e + 1;
+    }
+    gx.cn = n;
+  }
+  gx.oh = realloc(gx.oh, gx.cn * sizeof(*gx.oh));
+  memcpy(gx.oh, gx.ch, gx.cn * sizeof(*gx.oh));
+  gx.on = gx.cn;
+  for (int l = 0; l < gx.cn; l++) gx.cm[l] = l;
+  memset(gx.mk, 0, gx.cn);
+  gx.da = -1;
+  gx.gen = ++diff_gen;  // drops a job still running
+}
+
+// after an edit that removed nb newlines: rehash the lines it touched
+void gutter_edit(char *buf, int len, int pos, int nb, int lena) {
+  int line = line_of(buf, len, pos), na = count_lines(buf, pos, pos + lena);
+  int tail = gx.cn - (line + nb + 1);
+  gutter_grow(gx.cn + na - nb);
+  memmove(gx.ch + line + na + 1, gx.ch + line + nb + 1, tail * sizeof(*gx.ch));
+  memmove(gx.cm + line + na + 1, gx.cm + line + nb + 1, tail * sizeof(*gx.cm));
+  memmove(gx.mk + line + na + 1, gx.mk + line + nb + 1, tail);
+  gx.cn += na - nb;
+  for (int l = line, s = line_start(buf, len, pos); l <= line + na; l++) {
+    int e = line_end(buf, len, s);
+    gx.ch[l] = line_hash(buf + s, e - s);
+    gx.cm[l] = -1;
+    gx.mk[l] = '~';  // until the diff says otherwise
+    s = e + 1;
+  }
+  if (gx.da >= 0) {
+    gx.da = gx.da <= line ? gx.da : gx.da > line + nb ? gx.da + na - nb : line + na;
+    gx.db = gx.db <= line ? gx.db : gx.db > line + nb ? gx.db + na - nb : line + na + 1;
+    if (line < gx.da) gx.da = line;
+    if (line + na + 1 > gx.db) gx.db = line + na + 1;
+  } else {
+    gx.da = line;
+    gx.db = line + na + 1;
+  }
+  gx.gen = ++diff_gen;
+}
+
+// once per frame: take a finished job, start the next one
+void gutter_poll(char *buf) {
+  pthread_mutex_lock(&job_lock);
+  if (job.state == 2) {
+    if (job.text == buf && job.gen == gx.gen) {  // nothing changed meanwhile
+      for (int j = 0; j < job.cn; j++) {
+        gx.cm[job.ca + j] = job.m[j] >= 0 ? job.oa + job.m[j] : -1;
+        gx.mk[job.ca + j] = job.mk[j];
+      }
+      if (job.ca + job.cn < gx.cn) gx.mk[job.ca + job.cn] = job.tail;
+      gx.da = -1;
+    }
+    job.state = 0;
+  }
+  static int worker;
+  if (job.state == 0 && gx.da >= 0) {
+    if (!worker) {
+      pthread_t t;
+      if (!wake_open() || pthread_create(&t, NULL, diff_worker, NULL)) {
+        pthread_mutex_unlock(&job_lock);
+        return;
+      }
+      pthread_detach(t);
+      worker = 1;
+    }
+    int ca = gx.da, cb = gx.db;  // widened by a few matched lines, then to the next match
+    for (int k = 0; k < DIFF_CONTEXT && ca > 0; k++) do ca--; while (ca > 0 && gx.cm[ca - 1] < 0);
+    for (int k = 0; k < DIFF_CONTEXT && cb < gx.cn; k++) do cb++; while (cb < gx.cn && gx.cm[cb] < 0);
+    int oa = ca > 0 ? gx.cm[ca - 1] + 1 : 0, ob = cb < gx.cn ? gx.cm[cb] : gx.on;
+    job.on = ob - oa;
+    job.cn = cb - ca;
+    if (job.on > job.ocap) job.o = realloc(job.o, (job.ocap = job.on) * sizeof(*job.o));
+    if (job.cn > job.ccap) {
+      job.ccap = job.cn;
+      job.c = realloc(job.c, job.ccap * sizeof(*job.c));
+      job.m = realloc(job.m, job.ccap * sizeof(*job.m));
+      job.mk = realloc(job.mk, job.ccap);
+    }
+    memcpy(job.o, gx.oh + oa, job.on * sizeof(*job.o));
+    memcpy(job.c, gx.ch + ca, job.cn * sizeof(*job.c));
+    job.oa = oa;
+    job.ca = ca;
+    job.gen = gx.gen;
+    job.text = buf;
+    job.state = 1;
+    gx.da = ca;
+    gx.db = cb;
+    pthread_cond_signal(&job_cond);
+  }
+  pthread_mutex_unlock(&job_lock);
+}
+
+// mark of a line; lines deleted at the end of the file mark the last one
+char gutter_mark(int line) {
+  if (line >= gx.cn) return 0;
+  if (line == gx.cn - 1 && !gx.mk[line] && gx.cm[line] >= 0 && gx.cm[line] < gx.on - 1) return '-';
+  return gx.mk[line];
+}
+
+// first line of the next change after line, wrapping; -1 if none
+int gutter_next(int line) {
+  for (int k = 0, l = line; k < gx.cn; k++) {
+    int prev = l;
+    l = l + 1 < gx.cn ? l + 1 : 0;
+    char m = gutter_mark(l);
+    if (m && (!gutter_mark(prev) || l == 0 || m == '-')) return l;
+  }
+  return -1;
+}
+#endif
+
+#if ZT_COMPLETE
+// word index: every identifier in the text with its number of
+// occurrences, for completion. Words are what a double click selects;
+// only those of 3 to 64 bytes not starting with a digit are kept. Entries
+// are chained by their first two bytes, so a prefix lookup only walks
+// the words that share them. It is built on a background thread when
+// the file is loaded, and edits then update it for the words they touch
+#define WORD_MIN 3
+#define WORD_MAX 64
+
+struct word { unsigned hash; int off, len, count, next; };
+struct words {
+  struct word *w;
+  int n, cap;
+  int *slot, nslot;    // open addressing, entry + 1, 0 if free
+  char *arena;
+  long alen, acap;
+  int group[64 * 64];  // first entry + 1 for each two-byte start
+#if ZT_THREADS
+  pthread_t builder;
+  int building;
+#endif
+};
+struct words *wx;  // the current buffer's
+
+static unsigned char word_code[256];  // 1..63 for word bytes, 0 otherwise
+
+void word_init() {
+  if (word_code['a']) return;
+  int k = 1;
+  for (int c = 0; c < 256; c++)
+    if (isalnum(c) || c == '_') word_code[c] = k++;  // the C locale: 63 of them
+}
+
+unsigned word_hash(const char *s, int len) {
+  unsigned h = 2166136261u;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+  return h;
+}
+
+int words_find(struct words *x, const char *s, int len, unsigned h) {
+  if (!x->nslot) return -1;
+  for (int i = h & (x->nslot - 1); x->slot[i]; i = (i + 1) & (x->nslot - 1)) {
+    struct word *w = &x->w[x->slot[i] - 1];
+    if (w->hash == h && w->len == len && !memcmp(x->arena + w->off, s, len)) return x->slot[i] - 1;
+  }
+  return -1;
+}
+
+void words_add(struct words *x, const char *s, int len, unsigned h, int count) {
+  int k = words_find(x, s, len, h);
+  if (k >= 0 || count < 0) {  // words that are not there can't go away
+    if (k >= 0) x->w[k].count += count;
+    return;
+  }
+  if ((x->n + 1) * 2 > x->nslot) {
+    x->nslot = x->nslot ? x->nslot * 2 : 1024;
+    free(x->slot);
+    x->slot = calloc(x->nslot, sizeof(int));
+    for (int e = 0; e < x->n; e++) {
+      int i = x->w[e].hash & (x->nslot - 1);
+      while (x->slot[i]) i = (i + 1) & (x->nslot - 1);
+      x->slot[i] = e + 1;
+    }
+  }
+  if (x->n == x->cap) x->w = realloc(x->w, (x->cap = x->cap * 2 + 256) * sizeof(*x->w));
+  if (x->alen + len > x->acap) x->arena = realloc(x->arena, x->acap = (x->alen + len) * 2 + 4096);
+  memcpy(x->arena + x->alen, s, len);
+  int g = word_code[(unsigned char)s[0]] * 64 + word_code[(unsigned char)s[1]];
+  x->w[x->n] = (struct word){ h, x->alen, len, count, x->group[g] };
+  x->group[g] = x->n + 1;
+  x->alen += len;
+  int i = h & (x->nslot - 1);
+  while (x->slot[i]) i = (i + 1) & (x->nslot - 1);
+  x->slot[i] = ++x->n;
+}
+
+// count every word in buf[from, to) once more (delta 1) or once less
+void words_scan(struct words *x, const char *buf, int from, int to, int delta) {
+  for (int i = from; i < to; ) {
+    if (!word_code[(unsigned char)buf[i]]) { i++; continue; }
+    int s = i;
+    while (i < to && word_code[(unsigned char)buf[i]]) i++;
+    if (i - s >= WORD_MIN && i - s <= WORD_MAX && !isdigit((unsigned char)buf[s]))
+      words_add(x, buf + s, i - s, word_hash(buf + s, i - s), delta);
+  }
+}
+
+struct words_job {
+  struct words *x;
+  const char *buf;
+  int from, to;
+};
+
+void *words_chunk(void *arg) {
+  struct words_job *j = arg;
+  words_scan(j->x, j->buf, j->from, j->to, 1);
+  return NULL;
+}
+
+// the whole text, one chunk per core, then the chunks are merged
+void *words_builder(void *arg) {
+  struct words_job *top = arg;
+  struct words *part[MAX_THREADS];
+  struct words_job jobs[MAX_THREADS];
+#if ZT_THREADS
+  pthread_t tid[MAX_THREADS];
+#endif
+  int t = ZT_THREADS ? sysconf(_SC_NPROCESSORS_ONLN) : 1, from = top->from;
+  if (t > MAX_THREADS) t = MAX_THREADS;
+  if (t < 1 || top->to < (1 << 20)) t = 1;
+
+  for (int i = 0; i < t; i++) {
+    int to = i == t - 1 ? top->to : (int)((long)top->to * (i + 1) / t);
+    while (to < top->to && word_code[(unsigned char)top->buf[to]]) to++;  // not inside a word
+    part[i] = i ? calloc(1, sizeof(struct words)) : top->x;
+    jobs[i] = (struct words_job){ part[i], top->buf, from, to };
+    from = to;
+  }
+  int started[MAX_THREADS] = { 0 };
+#if ZT_THREADS
+  for (int i = 1; i < t; i++) started[i] = pthread_create(&tid[i], NULL, words_chunk, &jobs[i]) == 0;
+#endif
+  for (int i = 0; i < t; i++)
+    if (!started[i]) words_chunk(&jobs[i]);
+  for (int i = 1; i < t; i++) {
+#if ZT_THREADS
+    if (started[i]) pthread_join(tid[i], NULL);
+#endif
+    struct words *p = part[i];
+    for (int e = 0; e < p->n; e++)
+      words_add(top->x, p->arena + p->w[e].off, p->w[e].len, p->w[e].hash, p->w[e].count);
+    free(p->w); free(p->slot); free(p->arena); free(p);
+  }
+  free(top);
+  return NULL;
+}
+
+void words_start(struct words *x, const char *buf, int len) {
+  struct words_job *j = malloc(sizeof(*j));
+  *j = (struct words_job){ x, buf, 0, len };
+#if ZT_THREADS
+  x->building = pthread_create(&x->builder, NULL, words_builder, j) == 0;
+  if (!x->building)
+#endif
+  words_builder(j);
+}
+
+// the index can only be used or changed once the builder is done
+void words_wait(struct words *x) {
+#if ZT_THREADS
+  if (!x->building) return;
+  pthread_join(x->builder, NULL);
+  x->building = 0;
+#else
+  (void)x;
+#endif
+}
+
+void words_free(struct words *x) {
+  words_wait(x);
+  free(x->w); free(x->slot); free(x->arena); free(x);
+}
+
+// the words around an edit of [pos, pos + lenb): forgotten before it and
+// counted again after it (after = 1, with delta = lena - lenb)
+void words_edit(char *buf, int len, int pos, int lenb, int delta, int after) {
+  words_wait(wx);
+  int a = pos, b = pos + lenb + (after ? delta : 0);
+  while (a > 0 && word_code[(unsigned char)buf[a - 1]]) a--;
+  while (b < len && word_code[(unsigned char)buf[b]]) b++;
+  words_scan(wx, buf, a, b, after ? 1 : -1);
+}
+
+// the k most frequent words that extend prefix, best first
+int words_complete(const char *prefix, int plen, struct word *out, int k) {
+  words_wait(wx);
+  int n = 0, c0 = word_code[(unsigned char)prefix[0]];
+  if (!c0) return 0;
+  for (int c1 = 1; c1 < 64; c1++) {
+    if (plen > 1 && c1 != word_code[(unsigned char)prefix[1]]) continue;
+    for (int e = wx->group[c0 * 64 + c1]; e; e = wx->w[e - 1].next) {
+      struct word *w = &wx->w[e - 1];
+      if (w->count <= 0 || w->len <= plen || memcmp(wx->arena + w->off, prefix, plen)) continue;
+      int i = n < k ? n++ : k;
+      while (i > 0 && (out[i - 1].count < w->count || (out[i - 1].count == w->count && out[i - 1].len > w->len))) {
+        if (i < k) out[i] = out[i - 1];
+        i--;
+      }
+      if (i < k) out[i] = *w;
+    }
+  }
+  return n;
+}
+#endif
+
+// every edit of the text goes through here
+void replace_text(char *buf, int *len, int pos, int lenb, const char *after, int lena) {
+  if (grouping) group_edit(buf, *len, pos, lenb);
+  int touched = brk_touched(buf, *len, pos, lenb, after, lena);
+  folds_edit(buf, *len, pos, lenb, after, lena);  // needs the old line index
+#if ZT_GUTTER
+  if (!gx.ch) gutter_rebase(buf, *len);
+  int nb = count_lines(buf, pos, pos + lenb);
+#endif
+#if ZT_COMPLETE
+  words_edit(buf, *len, pos, lenb, lena - lenb, 0);
+#endif
+  mark_dirty(pos, lenb, lena);
+  views_edit(pos, lenb, lena);
+  line_index_edit(buf, pos, lenb, after, lena);
+  clips_edit(buf, pos);
+  if (lenb != lena)
+    memmove(buf + pos + lena, buf + pos + lenb, *len - (pos + lenb));
+  if (lena) memcpy(buf + pos, after, lena);
+  *len = *len - lenb + lena;
+  brk_edit(buf, *len, pos, lenb, lena, touched);
+#if ZT_GUTTER
+  gutter_edit(buf, *len, pos, nb, lena);
+#endif
+#if ZT_COMPLETE
+  words_edit(buf, *len, pos, lenb, lena - lenb, 1);
+#endif
+}
 
 // history 
 struct change {
   int pos;
-  int len_before;
-  int len_after;
-  char before[64];
-  char after[64];
+  struct clip *before;  // owned by whichever stack holds the entry
+  struct clip *after;
 };
 
-static struct change undo_stack[MAX_HISTORY];
+static struct change *undo_stack;
 static int undo_top = 0;
-static struct change redo_stack[MAX_HISTORY];
+static struct change *redo_stack;
 static int redo_top = 0;
 
+void free_change(struct change *c) {
+  clip_unref(c->before);
+  clip_unref(c->after);
+  c->before = c->after = NULL;
+}
+
 void clear_redo() {
-  redo_top = 0;
+  while (redo_top > 0) free_change(&redo_stack[--redo_top]);
 } 
 
-void record_change(int pos, const char *before, int lenb, const char *after, int lena) {
-  sprintf(status_msg,"record_change: pos=%d lenb=%d lena=%d", pos, lenb, lena);
+// takes over the references to before and after
+void record_clips(int pos, struct clip *before, struct clip *after) {
+  if (grouping) {  // the group is recorded as a whole
+    clip_unref(before);
+    clip_unref(after);
+    return;
+  }
   if (undo_top >= MAX_HISTORY) undo_top = 0; 
   struct change *c = &undo_stack[undo_top++];
+  free_change(c);
   c->pos = pos;
-  c->len_before = lenb;
-  c->len_after = lena;
-  memcpy(c->before, before, lenb);
-  memcpy(c->after, after, lena);
+  c->before = before;
+  c->after = after;
+  if (!before || !after) {  // out of memory: history can't be trusted
+    while (undo_top > 0) free_change(&undo_stack[--undo_top]);
+    sprintf(status_msg, "undo history dropped");
+  }
   clear_redo();
 }
 
+void record_change(int pos, const char *before, int lenb, const char *after, int lena) {
+#if ZT_TRACE
+  sprintf(status_msg,"record_change: pos=%d lenb=%d lena=%d", pos, lenb, lena);
+#endif
+  if (grouping) return;
+  record_clips(pos, clip_new(before, lenb, 0), clip_new(after, lena, 0));
+}
+
+void group_begin() {
+  grouping = 1;
+  group_head = group_end = 0;
+}
+
+void group_finish(char *buf, int len) {
+  int state = grouping;
+  grouping = 0;
+  if (state == 2)
+    record_clips(group_from, clip_new(group_mem + group_head, group_end - group_head, 0),
+                 clip_new(buf + group_from, len - group_tail - group_from, 1));
+  else if (state < 0)
+    record_clips(0, NULL, NULL);  // drops the history
+  free(group_mem);
+  group_mem = NULL;
+  group_cap = 0;
+}
+
 int undo(char *buf, int *len, int *pos) {
   sprintf(status_msg,"undo");
 
   if (undo_top == 0) return 0;
   struct change *c = &undo_stack[--undo_top];
   if (redo_top < MAX_HISTORY) redo_stack[redo_top++] = *c;
-  memmove(buf + c->pos + c->len_before, buf + c->pos + c->len_after, *len - (c->pos + c->len_after));
-  memcpy(buf + c->pos, c->before, c->len_before);
-  *len = *len - c->len_after + c->len_before;
-  *pos = c->pos + c->len_before;
+  replace_text(buf, len, c->pos, c->after->len, clip_bytes(c->before), c->before->len);
+  *pos = c->pos + c->before->len;
+  c->before = c->after = NULL;
   return 1;
 }
 
@@ -127,10 +1786,9 @@ int redo(char *buf, int *len, int *pos) {
   if (redo_top == 0) return 0;
   struct change *c = &redo_stack[--redo_top];
   if (undo_top < MAX_HISTORY) undo_stack[undo_top++] = *c;
-  memmove(buf + c->pos + c->len_after, buf + c->pos + c->len_before, *len - (c->pos + c->len_before));
-  memcpy(buf + c->pos, c->after, c->len_after);
-  *len = *len - c->len_before + c->len_after;
-  *pos = c->pos + c->len_after;
+  replace_text(buf, len, c->pos, c->before->len, clip_bytes(c->after), c->after->len);
+  *pos = c->pos + c->after->len;
+  c->before = c->after = NULL;
   return 1;
 }
 
@@ -140,45 +1798,228 @@ char *language = "text";
 struct Keyword {
   char word[32];
   char color[32];
+  int len;
+};
+
+static int no_keywords[257];
+struct Keyword *keywords;
+int *kw_first = no_keywords;
+
+#if ZT_HIGHLIGHT
+#define MAX_KEYWORDS  256
+#define MAX_LANGS     64
+#define MAX_EXTS      8
+#define CACHE_MAGIC   0x4353545a  // "ZTSC"
+#define CACHE_VERSION 1
+
+// compiled syntax cache, mmapped as is: a header, one entry per language,
+// then each language's keywords grouped by first byte
+struct cache_header {
+  int magic, version, nlang, size;
 };
 
-#define MAX_KEYWORDS 256
-struct Keyword keywords[MAX_KEYWORDS];
-int keyword_count = 0;
+struct cache_lang {
+  char name[32];
+  long long mtime;
+  char ext[MAX_EXTS][16];
+  int kw_off;
+  int first[257];   // keywords starting with byte c are [first[c], first[c + 1])
+};
 
-void load_keywords(const char *lang) {
-  keyword_count = 0;
+long long config_mtime(struct stat *st) {
+  return (long long)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
 
-  char path[128];
-  snprintf(path, sizeof(path), "%s/.config/zt/languages/%s.config", getenv("HOME"), lang);
+int is_config(const char *name, char *lang) {
+  int n = strlen(name);
+  if (n < 8 || n - 7 >= 32 || strcmp(name + n - 7, ".config")) return 0;
+  memcpy(lang, name, n - 7);
+  lang[n - 7] = 0;
+  return 1;
+}
 
+// parse one <lang>.config: "keyword color" lines, "@ext a b" adds extensions
+int read_config(const char *path, struct Keyword *kw, char ext[][16]) {
   FILE *fp = fopen(path, "r");
-  if (!fp) return;
+  if (!fp) return 0;
 
+  int count = 0, next = 0;
   char line[128];
   while (fgets(line, sizeof(line), fp)) {
-    if (keyword_count >= MAX_KEYWORDS) break;
+    char *tok = strtok(line, " \t\r\n");
+    if (tok && !strcmp(tok, "@ext")) {
+      while ((tok = strtok(NULL, " \t\r\n")) && next < MAX_EXTS)
+        snprintf(ext[next++], 16, "%s", tok);
+      continue;
+    }
+    if (count >= MAX_KEYWORDS) continue;
 
-    char *kw = strtok(line, " \t\r\n");
     char *col = strtok(NULL, " \t\r\n");
-
-    if (kw && col) {
-      strncpy(keywords[keyword_count].word, kw, 31);
-      snprintf(keywords[keyword_count].color, 31, "\033[%sm", col);
-      keyword_count++;
+    if (tok && col) {
+      memset(&kw[count], 0, sizeof(*kw));  // the cache image must not carry stack bytes
+      strncpy(kw[count].word, tok, 31);
+      snprintf(kw[count].color, 31, "\033[%sm", col);
+      kw[count].len = strlen(kw[count].word);
+      count++;
     }
   }
   fclose(fp);
+  return count;
+}
+
+// build the cache image from every config in dir
+char *compile_syntax(const char *dir) {
+  DIR *d = opendir(dir);
+  if (!d) return NULL;
+
+  int hsize = sizeof(struct cache_header) + MAX_LANGS * sizeof(struct cache_lang);
+  char *img = calloc(1, hsize + MAX_LANGS * MAX_KEYWORDS * sizeof(struct Keyword));
+  if (!img) { closedir(d); return NULL; }
+  struct cache_header *h = (struct cache_header *)img;
+  struct cache_lang *langs = (struct cache_lang *)(h + 1);
+  int total = 0;
+
+  struct dirent *de;
+  while ((de = readdir(d)) && h->nlang < MAX_LANGS) {
+    struct cache_lang *l = &langs[h->nlang];
+    char path[PATH_MAX];
+    struct stat st;
+    struct Keyword kw[MAX_KEYWORDS];
+
+    if (!is_config(de->d_name, l->name)) continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if (stat(path, &st)) continue;
+    l->mtime = config_mtime(&st);
+    int n = read_config(path, kw, l->ext);
+
+    // stable counting sort by first byte keeps the file's priority order
+    for (int k = 0; k < n; k++) l->first[(unsigned char)kw[k].word[0] + 1]++;
+    for (int c = 0; c < 256; c++) l->first[c + 1] += l->first[c];
+    int fill[256];
+    memcpy(fill, l->first, sizeof(fill));
+    l->kw_off = total;
+    struct Keyword *out = (struct Keyword *)(img + hsize) + total;
+    for (int k = 0; k < n; k++) out[fill[(unsigned char)kw[k].word[0]]++] = kw[k];
+    total += n;
+    h->nlang++;
+  }
+  closedir(d);
+
+  // keywords follow the languages that were actually found
+  int lsize = sizeof(struct cache_header) + h->nlang * sizeof(struct cache_lang);
+  memmove(img + lsize, img + hsize, total * sizeof(struct Keyword));
+  h->magic = CACHE_MAGIC;
+  h->version = CACHE_VERSION;
+  h->size = lsize + total * sizeof(struct Keyword);
+  return img;
+}
+
+// every table, offset and string of the cache lies within its size
+int syntax_sane(struct cache_header *h, long size) {
+  if (h->nlang < 0 || h->nlang > MAX_LANGS) return 0;
+  long lsize = sizeof(*h) + (long)h->nlang * sizeof(struct cache_lang);
+  if (size < lsize || (size - lsize) % sizeof(struct Keyword)) return 0;
+  long nkw = (size - lsize) / sizeof(struct Keyword);
+  struct cache_lang *langs = (struct cache_lang *)(h + 1);
+  for (int k = 0; k < h->nlang; k++) {
+    struct cache_lang *l = &langs[k];
+    if (l->name[sizeof(l->name) - 1] || l->kw_off < 0 || l->kw_off > nkw || l->first[0]) return 0;
+    for (int e = 0; e < MAX_EXTS; e++)
+      if (l->ext[e][sizeof(l->ext[e]) - 1]) return 0;
+    for (int c = 0; c < 256; c++)
+      if (l->first[c + 1] < l->first[c]) return 0;
+    if (l->first[256] > nkw - l->kw_off) return 0;
+  }
+  struct Keyword *kw = (struct Keyword *)(langs + h->nlang);
+  for (long k = 0; k < nkw; k++)
+    if (kw[k].word[sizeof(kw[k].word) - 1] || kw[k].color[sizeof(kw[k].color) - 1] ||
+        kw[k].len < 0 || kw[k].len >= (int)sizeof(kw[k].word)) return 0;
+  return 1;
+}
+
+// the cache is stale if any config was added, removed or touched, and
+// thrown away if it isn't sane
+int syntax_fresh(struct cache_header *h, long size, const char *dir) {
+  if (size < (long)sizeof(*h) || h->magic != CACHE_MAGIC ||
+      h->version != CACHE_VERSION || h->size != size || !syntax_sane(h, size)) return 0;
+  struct cache_lang *langs = (struct cache_lang *)(h + 1);
+
+  DIR *d = opendir(dir);
+  if (!d) return 0;
+  int found = 0, fresh = 1;
+  struct dirent *de;
+  while (fresh && (de = readdir(d))) {
+    char name[32], path[PATH_MAX];
+    struct stat st;
+    if (!is_config(de->d_name, name)) continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if (stat(path, &st)) continue;
+    int k = 0;
+    while (k < h->nlang && strcmp(langs[k].name, name)) k++;
+    fresh = k < h->nlang && langs[k].mtime == config_mtime(&st);
+    found++;
+  }
+  closedir(d);
+  return fresh && found == h->nlang;
 }
 
+void load_keywords(const char *ext) {
+  char dir[PATH_MAX], path[PATH_MAX + 16];
+  const char *home = getenv("HOME");
+  if (!home) return;
+  snprintf(dir, sizeof(dir), "%s/.config/zt/languages", home);
+  snprintf(path, sizeof(path), "%s/.config/zt/syntax.cache", home);
+
+  struct cache_header *h = NULL;
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd != -1) {
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (h == MAP_FAILED) h = NULL;
+      else if (!syntax_fresh(h, st.st_size, dir)) { munmap(h, st.st_size); h = NULL; }
+    }
+    close(fd);
+  }
+
+  if (!h) {
+    h = (struct cache_header *)compile_syntax(dir);
+    if (!h) return;
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    fd = mkstemp(tmp);
+    if (fd != -1) {
+      int ok = write(fd, h, h->size) == h->size;
+      close(fd);
+      if (!ok || rename(tmp, path)) unlink(tmp);
+    }
+  }
+
+  struct cache_lang *langs = (struct cache_lang *)(h + 1);
+  for (int k = 0; k < h->nlang; k++) {
+    int match = !strcmp(langs[k].name, ext);
+    for (int e = 0; e < MAX_EXTS && !match && langs[k].ext[e][0]; e++)
+      match = !strcmp(langs[k].ext[e], ext);
+    if (match) {
+      language = langs[k].name;
+      keywords = (struct Keyword *)(langs + h->nlang) + langs[k].kw_off;
+      kw_first = langs[k].first;
+      return;
+    }
+  }
+}
+#endif
+
 const char *get_extension(const char *name) {
   const char *dot = strrchr(name, '.');
   return (!dot || dot == name) ? "" : dot + 1;
 }
 
+#if ZT_HIGHLIGHT
 int match_keyword(char *buf, int i, int buflen, const char **color, const char **word) {
-  for (int k = 0; k < keyword_count; k++) {
-    int len = strlen(keywords[k].word);
+  unsigned char c = buf[i];
+  for (int k = kw_first[c]; k < kw_first[c + 1]; k++) {
+    int len = keywords[k].len;
     if (i + len <= buflen &&
         !strncmp(buf + i, keywords[k].word, len)) {
 
@@ -197,6 +2038,183 @@ int match_keyword(char *buf, int i, int buflen, const char **color, const char *
   }
   return 0;
 }
+#endif
+
+// how the bracket index skips strings and comments in this language
+int lex_for(const char *lang) {
+  static const char *hash[] = { "py", "python", "sh", "bash", "zsh", "rb", "ruby", "pl", "perl",
+                                "make", "yaml", "toml", "conf", "r", NULL };
+  if (!strcmp(lang, "text")) return 0;
+  for (int i = 0; hash[i]; i++)
+    if (!strcmp(lang, hash[i])) return LEX_HASH | LEX_QUOTES;
+  return LEX_SLASH | LEX_QUOTES;
+}
+
+// open buffers: the globals always describe the current one, the others
+// are parked here and swapped back in, so switching never rescans text
+#define MAX_BUFFERS 16
+struct buffer {
+  char *filename, *text;
+  int len, cap, pos, scroll, hscroll, sel_anchor, sel_mode, hex_mode;
+  long disk_len;
+  int reshaped, dirty_count;
+  struct range dirty[MAX_DIRTY];
+  struct change *undo_stack, *redo_stack;
+  int undo_top, redo_top;
+  int *ckpt;
+  int ckpt_count, ckpt_cap, scan_pos, scan_line, total_lines;
+  char *language;
+  struct Keyword *keywords;
+  int *kw_first;
+  struct brackets bx;
+  struct folds fx;
+#if ZT_GUTTER
+  struct gutter gx;
+#endif
+#if ZT_COMPLETE
+  struct words *wx;
+#endif
+};
+
+struct buffer bufs[MAX_BUFFERS];
+int nbufs = 0, cur_buf = 0;
+
+void buffer_park(struct buffer *b, int pos) {
+  line_index_wait();
+  b->filename = filename; b->cap = buf_cap; b->pos = pos;
+  b->scroll = scroll; b->hscroll = hscroll;
+  b->sel_anchor = sel_anchor; b->sel_mode = sel_mode; b->hex_mode = hex_mode;
+  b->disk_len = disk_len; b->reshaped = reshaped; b->dirty_count = dirty_count;
+  memcpy(b->dirty, dirty, sizeof(dirty));
+  b->undo_stack = undo_stack; b->undo_top = undo_top;
+  b->redo_stack = redo_stack; b->redo_top = redo_top;
+  b->ckpt = ckpt; b->ckpt_count = ckpt_count; b->ckpt_cap = ckpt_cap;
+  b->scan_pos = scan_pos; b->scan_line = scan_line; b->total_lines = total_lines;
+  b->language = language; b->keywords = keywords; b->kw_first = kw_first;
+  b->bx = bx;
+  b->fx = fx;
+#if ZT_GUTTER
+  b->gx = gx;
+#endif
+#if ZT_COMPLETE
+  b->wx = wx;
+#endif
+}
+
+// returns the cursor position of b
+int buffer_enter(struct buffer *b) {
+  filename = b->filename; buf_cap = b->cap;
+  scroll = b->scroll; hscroll = b->hscroll;
+  sel_anchor = b->sel_anchor; sel_mode = b->sel_mode; hex_mode = b->hex_mode;
+  hex_nibble = 0;
+  disk_len = b->disk_len; reshaped = b->reshaped; dirty_count = b->dirty_count;
+  memcpy(dirty, b->dirty, sizeof(dirty));
+  undo_stack = b->undo_stack; undo_top = b->undo_top;
+  redo_stack = b->redo_stack; redo_top = b->redo_top;
+  ckpt = b->ckpt; ckpt_count = b->ckpt_count; ckpt_cap = b->ckpt_cap;
+  scan_pos = b->scan_pos; scan_line = b->scan_line; total_lines = b->total_lines;
+  language = b->language; keywords = b->keywords; kw_first = b->kw_first;
+  bx = b->bx;
+  fx = b->fx;
+#if ZT_GUTTER
+  gx = b->gx;
+#endif
+#if ZT_COMPLETE
+  wx = b->wx;
+#endif
+  for (int k = 0; k < 2; k++) {
+    views[k].pos = b->pos;
+    views[k].scroll = scroll;
+    views[k].hscroll = hscroll;
+  }
+  return b->pos;
+}
+
+// load name into a new buffer; it becomes the current one
+int buffer_open(char *name) {
+  struct stat st;
+  if (nbufs == MAX_BUFFERS) return 0;
+
+  long size = name && stat(name, &st) == 0 ? st.st_size : 0;
+  char *text = buf_alloc(size);
+  if (!text) return 0;
+
+  struct buffer *b = &bufs[nbufs];
+  memset(b, 0, sizeof(*b));
+  b->filename = name ? name : "no-name";
+  b->text = text;
+  b->cap = buf_cap;
+  b->sel_anchor = -1;
+  b->disk_len = -1;
+  b->total_lines = -1;
+  b->language = "text";
+  b->kw_first = no_keywords;
+  b->undo_stack = calloc(MAX_HISTORY, sizeof(struct change));
+  b->redo_stack = calloc(MAX_HISTORY, sizeof(struct change));
+#if ZT_COMPLETE
+  b->wx = calloc(1, sizeof(struct words));
+  word_init();
+#endif
+  buffer_enter(b);
+  cur_buf = nbufs++;
+
+  if (!name) {
+    snprintf(status_msg, sizeof(status_msg), "new file (no name)");
+    buffer_park(b, 0);
+    return 1;
+  }
+#if ZT_HIGHLIGHT
+  load_keywords(get_extension(name));
+#else
+  if (*get_extension(name)) language = (char *)get_extension(name);  // close enough for lex_for
+#endif
+  bx.lex = lex_for(language);
+
+  FILE *f = fopen(name, "r");
+  if (f) {
+    int n;
+    while (b->len < buf_cap && (n = fread(text + b->len, 1, buf_cap - b->len, f)) > 0) b->len += n;
+    fclose(f);
+    mark_clean(b->len);
+    if (memchr(text, 0, b->len < 8192 ? b->len : 8192)) hex_mode = 1;
+#if ZT_COMPLETE
+    words_start(wx, text, b->len);
+#endif
+    snprintf(status_msg, sizeof(status_msg), "File %s loaded (%d byte)(%s)", name, b->len, language);
+  } else {
+    snprintf(status_msg, sizeof(status_msg), "New file: %s", name);
+  }
+  buffer_park(b, 0);  // keep what loading set up
+  return 1;
+}
+
+// drop the current buffer: its pages go back with one munmap
+void buffer_close() {
+  struct buffer *b = &bufs[cur_buf];
+  line_index_wait();
+  clips_edit(b->text, 0);  // copies must not point into unmapped text
+  while (undo_top > 0) free_change(&undo_stack[--undo_top]);
+  clear_redo();
+  free(undo_stack);
+  free(redo_stack);
+  free(ckpt);
+  free(bx.b);
+  free(bx.t);
+  free(bx.cmt);
+  free(fx.f);
+  free(fx.h);
+#if ZT_GUTTER
+  gutter_free();
+#endif
+#if ZT_COMPLETE
+  words_free(wx);
+#endif
+  munmap(b->text, buf_cap);
+
+  memmove(b, b + 1, (nbufs - cur_buf - 1) * sizeof(*b));
+  nbufs--;
+  if (cur_buf == nbufs && cur_buf > 0) cur_buf--;
+}
 
 void raw_mode(int enable) {
   static struct termios raw;
@@ -212,31 +2230,193 @@ void raw_mode(int enable) {
     raw.c_cc[VMIN] = 1;
     raw.c_cc[VTIME] = 0;
 
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
-    //tcsetattr(0, TCSANOW, &raw);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    //tcsetattr(0, TCSANOW, &raw);
+
+    printf("\033[?1000h"); 
+    printf("\033[?1002h"); 
+    printf("\033[?1006h"); 
+
+  } else {
+    tcsetattr(0, TCSANOW, &orig);
+    printf("\033[0m\033[2J\033[H\033[?25h");
+    printf("\033[?1000l"); 
+    printf("\033[?1002l");
+    printf("\033[?1006l");
+
+    fflush(stdout);
+    int tmp=system("stty sane"); 
+  }
+}
+
+int utf8_charlen(unsigned char c) {
+  if (c < 128) return 1;
+  if ((c >> 5) == 0x6) return 2;
+  if ((c >> 4) == 0xE) return 3;
+  if ((c >> 3) == 0x1E) return 4;
+  return 1;
+}
+
+// decode one codepoint; invalid, overlong or truncated sequences decode
+// as a single byte so the cursor never lands inside garbage
+int utf8_decode(const char *s, int n, int *cp) {
+  const unsigned char *u = (const unsigned char *)s;
+  int c = u[0];
+  *cp = c;
+  if (c < 0x80) return 1;
+
+  int len = utf8_charlen(c);
+  if (len == 1 || len > n || c < 0xC2 || c > 0xF4) return 1;
+  for (int k = 1; k < len; k++)
+    if ((u[k] & 0xC0) != 0x80) return 1;
+
+  if (len == 2) {
+    *cp = ((c & 0x1F) << 6) | (u[1] & 0x3F);
+  } else if (len == 3) {
+    int v = ((c & 0x0F) << 12) | ((u[1] & 0x3F) << 6) | (u[2] & 0x3F);
+    if (v < 0x800 || (v >= 0xD800 && v <= 0xDFFF)) return 1;
+    *cp = v;
+  } else {
+    int v = ((c & 0x07) << 18) | ((u[1] & 0x3F) << 12) | ((u[2] & 0x3F) << 6) | (u[3] & 0x3F);
+    if (v < 0x10000 || v > 0x10FFFF) return 1;
+    *cp = v;
+  }
+  return len;
+}
+
+// display width: East Asian wide/fullwidth and combining marks,
+// kept as sorted ranges and searched only for codepoints >= 0x300
+static const int wide_ranges[][2] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+  {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+  {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+  {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+  {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+  {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+  {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+  {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+  {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+  {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+  {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+  {0x17000, 0x18CFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+  {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251}, {0x1F300, 0x1F320},
+  {0x1F32D, 0x1F335}, {0x1F337, 0x1F37C}, {0x1F37E, 0x1F393}, {0x1F3A0, 0x1F3CA},
+  {0x1F3CF, 0x1F3D3}, {0x1F3E0, 0x1F3F0}, {0x1F3F4, 0x1F3F4}, {0x1F3F8, 0x1F3FA},
+  {0x1F400, 0x1F43E}, {0x1F440, 0x1F440}, {0x1F442, 0x1F4FC}, {0x1F4FF, 0x1F53D},
+  {0x1F54B, 0x1F54E}, {0x1F550, 0x1F567}, {0x1F57A, 0x1F57A}, {0x1F595, 0x1F596},
+  {0x1F5A4, 0x1F5A4}, {0x1F5FB, 0x1F64F}, {0x1F680, 0x1F6C5}, {0x1F6CC, 0x1F6CC},
+  {0x1F6D0, 0x1F6D2}, {0x1F6D5, 0x1F6D7}, {0x1F6DC, 0x1F6DF}, {0x1F6EB, 0x1F6EC},
+  {0x1F6F4, 0x1F6FC}, {0x1F7E0, 0x1F7EB}, {0x1F7F0, 0x1F7F0}, {0x1F90C, 0x1F93A},
+  {0x1F93C, 0x1F945}, {0x1F947, 0x1F9FF}, {0x1FA70, 0x1FAFF}, {0x20000, 0x2FFFD},
+  {0x30000, 0x3FFFD},
+};
+
+static const int zero_ranges[][2] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+  {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+  {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+  {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902}, {0x093A, 0x093A},
+  {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+  {0x0962, 0x0963}, {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E},
+  {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x2060, 0x2064},
+  {0x20D0, 0x20FF}, {0x302A, 0x302D}, {0x3099, 0x309A}, {0xFE00, 0xFE0F},
+  {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0x1F3FB, 0x1F3FF}, {0xE0001, 0xE007F},
+  {0xE0100, 0xE01EF},
+};
+
+static int in_ranges(int cp, const int (*r)[2], int n) {
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < r[mid][0]) hi = mid - 1;
+    else if (cp > r[mid][1]) lo = mid + 1;
+    else return 1;
+  }
+  return 0;
+}
+
+int utf8_width(int cp) {
+  if (cp < 0x300) return 1;
+  if (cp >= 0x4E00 && cp <= 0x9FFF) return 2;  // CJK ideographs, the common case
+  if (in_ranges(cp, zero_ranges, sizeof(zero_ranges) / sizeof(zero_ranges[0]))) return 0;
+  if (in_ranges(cp, wide_ranges, sizeof(wide_ranges) / sizeof(wide_ranges[0]))) return 2;
+  return 1;
+}
+
+// length of the pure ASCII prefix of s, scanned 16 or 8 bytes at a time
+int ascii_span(const char *s, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16)
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)))) break;
+#endif
+  for (; i + 8 <= n; i += 8) {
+    unsigned long long w;
+    memcpy(&w, s + i, 8);
+    if (w & 0x8080808080808080ULL) break;
+  }
+  while (i < n && !(s[i] & 0x80)) i++;
+  return i;
+}
+
+// one codepoint: returns its byte length and stores its display width
+int utf8_step(const char *s, int n, int *w) {
+  int cp, clen = utf8_decode(s, n, &cp);
+  *w = utf8_width(cp);
+  return clen;
+}
 
-    printf("\033[?1000h"); 
-    printf("\033[?1002h"); 
-    printf("\033[?1006h"); 
+// display columns of buf[from, to), which must not span a newline
+int utf8_cols(const char *buf, int from, int to) {
+  int cols = 0;
+  while (from < to) {
+    int a = ascii_span(buf + from, to - from);
+    cols += a;
+    from += a;
+    if (from < to) {
+      int w;
+      from += utf8_step(buf + from, to - from, &w);
+      cols += w;
+    }
+  }
+  return cols;
+}
 
-  } else {
-    tcsetattr(0, TCSANOW, &orig);
-    printf("\033[0m\033[2J\033[H\033[?25h");
-    printf("\033[?1000l"); 
-    printf("\033[?1002l");
-    printf("\033[?1006l");
+// byte offset of display column col on the line starting at start
+int col_to_pos(const char *buf, int len, int start, int col) {
+  int pos = start, c = 0;
+  while (pos < len && buf[pos] != '\n') {
+    int w, clen = utf8_step(buf + pos, len - pos, &w);
+    if (c + w > col) break;
+    c += w;
+    pos += clen;
+  }
+  return pos;
+}
 
-    fflush(stdout);
-    int tmp=system("stty sane"); 
+// next/previous cursor stop: skips continuation bytes and combining marks
+int next_char(const char *buf, int len, int pos) {
+  int w;
+  if (pos < len) pos += utf8_step(buf + pos, len - pos, &w);
+  while (pos < len && (unsigned char)buf[pos] >= 0xCC) {
+    int clen = utf8_step(buf + pos, len - pos, &w);
+    if (w) break;
+    pos += clen;
   }
+  return pos;
 }
 
-int utf8_charlen(unsigned char c) {
-  if (c < 128) return 1;
-  if ((c >> 5) == 0x6) return 2;
-  if ((c >> 4) == 0xE) return 3;
-  if ((c >> 3) == 0x1E) return 4;
-  return 1;
+int prev_char(const char *buf, int len, int pos) {
+  while (pos > 0) {
+    int w;
+    do {
+      pos--;
+    } while (pos > 0 && (buf[pos] & 0xC0) == 0x80);
+    utf8_step(buf + pos, len - pos, &w);
+    if (w) break;
+  }
+  return pos;
 }
 
 int utf8_isalnum(const char *s, int len) {
@@ -259,7 +2439,130 @@ void get_terminal_size() {
   }
 }
 
+// input: our own buffer over fd 0, so queued reports can be looked at
+// before deciding what to do with them
+static unsigned char in_buf[4096];
+static int in_head = 0, in_tail = 0;
+
+// read what is available, waiting up to timeout ms (-1 = forever)
+int in_fill(int timeout) {
+  if (in_head > 0) {
+    memmove(in_buf, in_buf + in_head, in_tail - in_head);
+    in_tail -= in_head;
+    in_head = 0;
+  }
+  if (in_tail == sizeof(in_buf)) return 1;
+  struct pollfd p = { 0, POLLIN, 0 };
+  if (poll(&p, 1, timeout) <= 0) return 0;
+  int n = read(0, in_buf + in_tail, sizeof(in_buf) - in_tail);
+  if (n > 0) in_tail += n;
+  return n > 0;
+}
+
+int in_getc() {
+  if (in_head == in_tail && !in_fill(-1)) return -1;
+  return in_buf[in_head++];
+}
+
+// next byte only if it has already arrived
+int in_getc_now() {
+  if (in_head == in_tail && !in_fill(0)) return -1;
+  return in_buf[in_head++];
+}
+
+// decimal number; *term gets the byte that ended it
+int in_num(int *term) {
+  int v = 0, c;
+  while ((c = in_getc()) >= '0' && c <= '9') v = v * 10 + c - '0';
+  *term = c;
+  return v;
+}
+
+// if the next queued input is another drag report, take it instead
+int next_motion() {
+  in_fill(0);
+  unsigned char *p = in_buf + in_head, *end = in_buf + in_tail;
+  int v[3] = { 0, 0, 0 };
+  if (end - p < 3 || memcmp(p, "\033[<", 3)) return 0;
+  p += 3;
+  for (int k = 0; k < 3; k++) {
+    if (p == end || !isdigit(*p)) return 0;
+    while (p < end && isdigit(*p)) v[k] = v[k] * 10 + *p++ - '0';
+    if (p == end || *p != (k < 2 ? ';' : 'M')) return 0;
+    p++;
+  }
+  if (!(v[0] & 32)) return 0;
+  mouse_x = v[1];
+  mouse_y = v[2];
+  in_head = p - in_buf;
+  return 1;
+}
+
+// terminal capabilities: what draw may use besides cursor moves and EL.
+// $TERM rules out what can't be asked about; then DECRQM asks for mode
+// 2026 and DA1, which almost every terminal answers, ends the wait
+#define CAP_SCROLL 1  // scroll regions with insert/delete line
+#define CAP_ECH    2  // erase characters
+#define CAP_REP    4  // repeat the last character
+#define CAP_SYNC   8  // DEC mode 2026 synchronized updates
+int term_caps = 0;
+int term_rep = 0;     // $TERM names a terminal known to do REP
+int term_answered = 0;
+
+// a reply to a query, without its "\033[?": DA1 "64;1;2c" or DECRQM
+// "2026;2$y". Late ones still arrive, through read_key
+void term_reply(const char *s, int n) {
+  char r[32];
+  int a = 0, b = 0;
+  char fin = n ? s[n - 1] : 0;
+  snprintf(r, sizeof(r), "%.*s", n, s);
+  sscanf(r, "%d;%d", &a, &b);
+  if (fin == 'c') {
+    term_caps |= CAP_SCROLL | (a >= 62 ? CAP_ECH : 0) | (term_rep ? CAP_REP : 0);  // 62+: VT220 or later
+    term_answered = 1;
+  } else if (fin == 'y' && a == 2026 && b >= 1 && b <= 3) {
+    term_caps |= CAP_SYNC;
+  }
+}
+
+void term_detect() {
+  static const char *rep[] = { "xterm", "foot", "alacritty", "wezterm", "contour", "tmux", NULL };
+  const char *t = getenv("TERM");
+  if (!t || !*t || !strcmp(t, "dumb")) return;
+  if (!strncmp(t, "linux", 5)) {  // the console: no REP or mode 2026, and DECRQM goes unanswered
+    term_caps = CAP_SCROLL | CAP_ECH;
+    return;
+  }
+  for (int i = 0; rep[i]; i++) term_rep |= !strncmp(t, rep[i], strlen(rep[i]));
+  printf("\033[?2026$p\033[c");
+  fflush(stdout);
+
+  // take the replies out of the input, keys typed meanwhile stay
+  struct timeval t0, now;
+  gettimeofday(&t0, NULL);
+  for (int ms = 0; !term_answered && ms < 300; ) {
+    in_fill(300 - ms);
+    for (int i = in_head; i + 2 < in_tail; i++) {
+      if (memcmp(in_buf + i, "\033[?", 3)) continue;
+      int j = i + 3;
+      while (j < in_tail && (isdigit(in_buf[j]) || in_buf[j] == ';' || in_buf[j] == '$')) j++;
+      if (j == in_tail) break;  // the rest is still on its way
+      term_reply((char *)in_buf + i + 3, j + 1 - (i + 3));
+      memmove(in_buf + i, in_buf + j + 1, in_tail - j - 1);
+      in_tail -= j + 1 - i;
+      i--;
+    }
+    gettimeofday(&now, NULL);
+    ms = (now.tv_sec - t0.tv_sec) * 1000 + (now.tv_usec - t0.tv_usec) / 1000;
+  }
+}
+
 char *get_input(const char *label, char *buffer, int size) {
+  if (playing) {  // the answer given while recording
+    const char *text = macro[play_at - 1].text;
+    snprintf(buffer, size, "%s", text ? text : "");
+    return buffer;
+  }
   int len = strlen(buffer);
 
   printf("\033[%d;1H\033[30;107m", term_rows);
@@ -267,7 +2570,7 @@ char *get_input(const char *label, char *buffer, int size) {
   fflush(stdout);
 
   while (1) {
-    int c = getchar();
+    int c = in_getc();
     if (c == '\n' || c == '\r') break;
 
     if ((c == 8 || c == 127) && len > 0) {
@@ -282,6 +2585,35 @@ char *get_input(const char *label, char *buffer, int size) {
     fflush(stdout);
   }
 
+  status_hash = 0;  // the prompt is still there
+  if (recording && macro_len) {
+    free(macro[macro_len - 1].text);
+    macro[macro_len - 1].text = strdup(buffer);
+  }
+  return buffer;
+}
+
+// a prompt that shows * for each byte and is never recorded in a macro
+// or answered by one
+char *get_secret(const char *label, char *buffer, int size) {
+  int len = 0;
+  buffer[0] = 0;
+  while (1) {
+    printf("\033[%d;1H\033[30;107m\033[K%s", term_rows, label);
+    for (int i = 0; i < len; i++) putchar('*');
+    printf("\033[0m");
+    fflush(stdout);
+
+    int c = in_getc();
+    if (c == '\n' || c == '\r' || c < 0) break;
+    if ((c == 8 || c == 127) && len > 0) {
+      buffer[--len] = 0;
+    } else if (c >= 32 && c < 127 && len < size - 1) {
+      buffer[len++] = c;
+      buffer[len] = 0;
+    }
+  }
+  status_hash = 0;
   return buffer;
 }
 
@@ -294,11 +2626,52 @@ int search(char *buf, int len, int start, const char *needle) {
   return -1;
 }
 
+// where a goto answer points: LINE[:COL] counted from 1, @OFFSET in bytes
+// (decimal, or hex after 0x) or N% of the lines; -1 if it is none of these
+int goto_pos(char *buf, int len, const char *s) {
+  char *end;
+  if (*s == '@') {
+    int hex = s[1] == '0' && (s[2] == 'x' || s[2] == 'X');
+    const char *d = s + 1 + 2 * hex;
+    if (!*d || d[strspn(d, hex ? "0123456789abcdefABCDEF" : "0123456789")]) return -1;
+    long off = strtol(d, &end, hex ? 16 : 10);
+    if (off < 0) return -1;
+    int pos = off < len ? off : len;
+    if (!hex_mode)
+      while (pos > 0 && pos < len && (buf[pos] & 0xC0) == 0x80) pos--;  // not inside a character
+    return pos;
+  }
+  long n = strtol(s, &end, 10), col = 1;
+  if (end == s || n < 0) return -1;
+  if (*end == '%' && !end[1]) {
+    line_index_extend(buf, len, -1, INT_MAX);  // the line count
+    return line_offset(buf, len, (long)(total_lines - 1) * (n < 100 ? n : 100) / 100);
+  }
+  if (*end == ':') {
+    const char *c = end + 1;
+    col = strtol(c, &end, 10);
+    if (end == c || col < 1) return -1;
+  }
+  if (*end) return -1;
+  int start = line_offset(buf, len, n < 1 ? 0 : n > INT_MAX ? INT_MAX : n - 1);
+  return col_to_pos(buf, len, start, col > INT_MAX ? INT_MAX : col - 1);
+}
+
 int read_key() {
   static int last_click_time = 0;
   static int click_count = 0;
 
-  int c = getchar();
+#if ZT_THREADS
+  if (in_head == in_tail && wake_pipe[0] >= 0) {  // wait for a key or a worker
+    struct pollfd p[2] = { { 0, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
+    if (poll(p, 2, -1) > 0 && !(p[0].revents & POLLIN)) {
+      char t[16];
+      while (read(wake_pipe[0], t, sizeof(t)) > 0) {}
+      return WORKER_DONE;
+    }
+  }
+#endif
+  int c = in_getc();
 
   if (c== 1) return SELECTALL; //CTRL+A
   if (c == 13) return 10; // Return
@@ -312,39 +2685,87 @@ int read_key() {
   
   if (c == 21) return CTRL_U;  // Ctrl+U
   if (c == 11) return CTRL_K;  // Ctrl+K
+  if (c == 18) return CTRL_R;  // Ctrl+R
+#if ZT_COMPLETE
+  if (c == 14) return COMPLETE;  // Ctrl+N
+#endif
 
   if (c == 31) return SEARCH;   // Ctrl+7 - find
   if (c == 0) return SAVE; // Ctrl+2 - save
   
-  if (c == 194)return 194;
-  if (c == 195) return 195; 
+  if (c >= 0xC2 && c <= 0xF4) { // UTF-8 lead byte: read the whole sequence
+    utf8_input_len = utf8_charlen(c);
+    utf8_input[0] = c;
+    for (int k = 1; k < utf8_input_len; k++) utf8_input[k] = in_getc();
+    return UTF8_CHAR;
+  }
 
   if (c == 27) { // ESC    
-    fcntl(0, F_SETFL, O_NONBLOCK); int seq1 = getchar(); fcntl(0, F_SETFL, 0);
+    int seq1 = in_getc_now();
     if (seq1 ==-1) return KEY_ESC;
     if (seq1=='O') {
-      int seq2= getchar();
+      int seq2= in_getc();
       if ( seq2=='Q')return SAVE; //F2
       if ( seq2=='R'){sel_persistent ^=1; return 0; }//F3
+      if ( seq2=='S')return HEXMODE; //F4
     }
 
     if (seq1 == 'h') return TOP; // Alt+h → "begin file"
     if (seq1 == 'e') return BOTTOM; // Alt+e → "end file"
+    if (seq1 == 'y') return YANK; // Alt+y → paste last kill
+    if (seq1 == 'n') return NEXTBUF; // Alt+n → next file
+    if (seq1 == 'p') return PREVBUF; // Alt+p → previous file
+    if (seq1 == 's') return SPLIT; // Alt+s → split above/below
+    if (seq1 == 'v') return VSPLIT; // Alt+v → split side by side
+    if (seq1 == 'w') return OTHERVIEW; // Alt+w → other view
+    if (seq1 == 'l') return LINEOPS; // Alt+l → sort/uniq/keep/drop lines
+    if (seq1 == '|') return PIPE; // Alt+| → filter through a command
+    if (seq1 == 'm') return RECORD; // Alt+m → start/stop macro recording
+    if (seq1 == 'x') return RUNMACRO; // Alt+x → play the macro
+    if (seq1 == 'b') return MATCHBRACKET; // Alt+b → matching bracket
+    if (seq1 == 'u') return ENCLOSING; // Alt+u → up to the enclosing block
+    if (seq1 == 'f') return FOLD; // Alt+f → fold/unfold here
+    if (seq1 == 'F') return FOLDALL; // Alt+Shift+f → fold/unfold all
+#if ZT_GUTTER
+    if (seq1 == 'j') return NEXTCHANGE; // Alt+j → next changed line
+#endif
+    if (seq1 == 'g') return GOTO; // Alt+g → go to line, offset or percentage
         
     if (seq1 == '[') {
-      int seq2 = getchar();
+      int seq2 = in_getc();
     
+      if (seq2 == '?') {  // a late reply to term_detect
+        char r[32];
+        int n = 0, c;
+        do {
+          c = in_getc();
+          if (n < (int)sizeof(r) - 1) r[n++] = c;
+        } while (c >= 0 && (isdigit(c) || c == ';' || c == '$'));
+        r[n] = 0;
+        term_reply(r, n);
+        return 0;
+      }
+
       if ( seq2 == '['){
-        int seq3 = getchar();
+        int seq3 = in_getc();
         if ( seq3 =='B')return SAVE; //F2 in tty
         if ( seq3 =='C'){sel_persistent ^=1; return 0; }//F3 in tty
+        if ( seq3 =='D')return HEXMODE; //F4 in tty
       }
 
       if ( seq2 == '<') {
-        int btn = 0;
-        char c;
-        int tmp = scanf("%d;%d;%d%c", &btn, &mouse_x, &mouse_y, &c);
-        
+        int c;
+        int btn = in_num(&c);
+        mouse_x = in_num(&c);
+        mouse_y = in_num(&c);
+
+        mouse_drag = 0;
+        if (c == 'M' && (btn & 32)) { // drag: only the latest position matters
+          while (next_motion());
+          mouse_b = 1;
+          mouse_drag = 1;
+          return MOUSE_MOVE;
+        }
         if (c == 'm') {
           mouse_b = 0;
           click_count++;
@@ -398,24 +2819,27 @@ int read_key() {
         case 'F': return KEY_END;    // End
 
         case '5':
-          if (getchar() == '~') return KEY_PAGEUP; // PageUp
+          if (in_getc() == '~') return KEY_PAGEUP; // PageUp
           break;
         case '6':
-          if (getchar() == '~') return KEY_PAGEDOWN; // PageDown
+          if (in_getc() == '~') return KEY_PAGEDOWN; // PageDown
           break;
                 
         case '3':
-          if (getchar() == '~') return DELETE; // Delete
+          if (in_getc() == '~') return DELETE; // Delete
           break;
-        case '2':
-          if (getchar() == '1' && getchar() == '~') return EXITSAVE; // F10
+        case '2': {
+          int next = in_getc();
+          if (next == '~') return KEY_INSERT; // Insert
+          if (next == '1' && in_getc() == '~') return EXITSAVE; // F10
           break;
+        }
         case '1': {
-          int next = getchar();
-          if (next == '8' && getchar() == '~') return SEARCH;//F7
+          int next = in_getc();
+          if (next == '8' && in_getc() == '~') return SEARCH;//F7
           if (next == ';') {
-            int mod = getchar();
-            int final = getchar();
+            int mod = in_getc();
+            int final = in_getc();
             if (mod == '2') {
               switch (final) {
                 case 'A': return SELECTUP; // Shift+Up
@@ -436,7 +2860,7 @@ int read_key() {
         }
       }
     } else if (seq1 == 'O') {
-      int seq2 = getchar();
+      int seq2 = in_getc();
       switch (seq2) {
         case 'P': return 0xF1; // F1
         case 'Q': return 0xF2; // F2
@@ -444,217 +2868,1117 @@ int read_key() {
         case 'S': return 0xF4; // F4
       }
     }
-    return 0;// unknow
+    return 0;// unknow
+  }
+  return c; 
+}
+
+int move_vert(char *buf, int len, int pos, int dir) {
+  int start = line_start(buf, len, pos);
+  int col = utf8_cols(buf, start, pos);
+  int new_start;
+
+  if (fx.nh) {  // step over folded lines
+    int line = line_of(buf, len, pos), k;
+    if (dir < 0 && start > 0) {
+      k = fold_hidden(line - 1);
+      new_start = line_offset(buf, len, k >= 0 ? fx.h[k].from - 1 : line - 1);
+    } else if (dir > 0) {
+      k = fold_hidden(line + 1);
+      int end = k >= 0 ? line_end(buf, len, line_offset(buf, len, fx.h[k].to)) : line_end(buf, len, pos);
+      if (end >= len) return pos;
+      new_start = end + 1;
+    } else {
+      return pos;
+    }
+  } else if (dir < 0 && start > 0) new_start = line_start(buf, len, start - 1);
+  else if (dir > 0 && line_end(buf, len, pos) < len) new_start = line_end(buf, len, pos) + 1;
+  else return pos;
+
+  return col_to_pos(buf, len, new_start, col);
+}
+
+// line operations on a range of whole lines: the lines are sorted or
+// filtered as (key, start, len) records, then the text is written once
+// into a new piece that replaces the range as a single undo step
+struct line {
+  unsigned long long key;  // first 8 bytes big-endian, or the number for -n
+  int start, len;
+};
+
+static const char *lines_buf;
+static int lines_flags;
+#define LINES_NUMERIC 1
+#define LINES_REVERSE 2
+#define LINES_UNIQUE  4
+
+int line_cmp(const struct line *a, const struct line *b) {
+  int r = a->key < b->key ? -1 : a->key > b->key;
+  if (!r && !(lines_flags & LINES_NUMERIC)) {
+    int n = a->len < b->len ? a->len : b->len;
+    r = memcmp(lines_buf + a->start, lines_buf + b->start, n);
+    if (!r) r = a->len < b->len ? -1 : a->len > b->len;
+  }
+  return lines_flags & LINES_REVERSE ? -r : r;
+}
+
+unsigned long long line_key(const char *s, int len) {
+  unsigned long long k = 0;
+  if (lines_flags & LINES_NUMERIC) {
+    char tmp[64];
+    int n = len < 63 ? len : 63;
+    memcpy(tmp, s, n);
+    tmp[n] = 0;
+    double d = strtod(tmp, NULL);
+    memcpy(&k, &d, sizeof(k));
+    return k >> 63 ? ~k : k | 1ULL << 63;  // doubles ordered as integers
+  }
+  for (int i = 0; i < 8; i++) k = k << 8 | (i < len ? (unsigned char)s[i] : 0);
+  return k;
+}
+
+// stable merge of a and b into out
+void merge_lines(struct line *a, long na, struct line *b, long nb, struct line *out) {
+  while (na && nb) {
+    if (line_cmp(b, a) < 0) *out++ = *b++, nb--;
+    else *out++ = *a++, na--;
+  }
+  memcpy(out, a, na * sizeof(*a));
+  memcpy(out + na, b, nb * sizeof(*b));
+}
+
+void sort_lines(struct line *a, struct line *tmp, long n) {
+  if (n <= 16) {
+    for (long i = 1; i < n; i++) {
+      struct line x = a[i];
+      long j = i;
+      for (; j > 0 && line_cmp(&x, &a[j - 1]) < 0; j--) a[j] = a[j - 1];
+      a[j] = x;
+    }
+    return;
+  }
+  long h = n / 2;
+  sort_lines(a, tmp, h);
+  sort_lines(a + h, tmp + h, n - h);
+  if (line_cmp(&a[h], &a[h - 1]) >= 0) return;
+  merge_lines(a, h, a + h, n - h, tmp);
+  memcpy(a, tmp, n * sizeof(*a));
+}
+
+// one thread's share: sort a chunk, or produce out[lo, hi) of a merge
+struct sort_job {
+  struct line *a, *b, *out;
+  long na, nb, lo, hi;
+};
+
+// how many of the first k merged records come from a
+long merge_split(struct line *a, long na, struct line *b, long nb, long k) {
+  long lo = k > nb ? k - nb : 0, hi = k < na ? k : na;
+  while (lo < hi) {
+    long i = (lo + hi) / 2;
+    if (line_cmp(&a[i], &b[k - i - 1]) <= 0) lo = i + 1;
+    else hi = i;
+  }
+  return lo;
+}
+
+void *sort_worker(void *arg) {
+  struct sort_job *j = arg;
+  if (!j->b) {
+    sort_lines(j->a, j->out, j->na);
+    return NULL;
+  }
+  long i0 = merge_split(j->a, j->na, j->b, j->nb, j->lo);
+  long i1 = merge_split(j->a, j->na, j->b, j->nb, j->hi);
+  merge_lines(j->a + i0, i1 - i0, j->b + j->lo - i0, (j->hi - i1) - (j->lo - i0), j->out + j->lo);
+  return NULL;
+}
+
+void run_jobs(struct sort_job *jobs, int n) {
+#if ZT_THREADS
+  pthread_t tid[MAX_THREADS];
+  int started = 0;
+  for (int i = 1; i < n; i++)
+    if (pthread_create(&tid[started], NULL, sort_worker, &jobs[i]) == 0) started++;
+    else sort_worker(&jobs[i]);
+  sort_worker(&jobs[0]);
+  for (int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+#else
+  for (int i = 0; i < n; i++) sort_worker(&jobs[i]);
+#endif
+}
+
+// sort the chunks in parallel, then merge pairs of runs, each merge
+// split across the threads so the last rounds are not serial
+void parallel_sort(struct line *a, struct line *tmp, long n) {
+  struct sort_job jobs[MAX_THREADS];
+  long bound[MAX_THREADS + 1];
+  int t = ZT_THREADS ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  if (t > MAX_THREADS) t = MAX_THREADS;
+  if (t < 1 || n < 65536) t = 1;
+
+  for (int i = 0; i <= t; i++) bound[i] = n * i / t;
+  for (int i = 0; i < t; i++)
+    jobs[i] = (struct sort_job){ a + bound[i], NULL, tmp + bound[i], bound[i + 1] - bound[i], 0, 0, 0 };
+  run_jobs(jobs, t);
+
+  struct line *src = a, *dst = tmp;
+  for (int runs = t; runs > 1; runs = (runs + 1) / 2) {
+    int pairs = runs / 2, parts = t / pairs, njobs = 0;
+    for (int p = 0; p < pairs; p++) {
+      long na = bound[2 * p + 1] - bound[2 * p], nb = bound[2 * p + 2] - bound[2 * p + 1];
+      for (int q = 0; q < parts; q++)
+        jobs[njobs++] = (struct sort_job){ src + bound[2 * p], src + bound[2 * p + 1], dst + bound[2 * p],
+                                           na, nb, (na + nb) * q / parts, (na + nb) * (q + 1) / parts };
+    }
+    if (runs & 1) memcpy(dst + bound[runs - 1], src + bound[runs - 1], (n - bound[runs - 1]) * sizeof(*a));
+    run_jobs(jobs, njobs);
+    for (int p = 0; p <= (runs + 1) / 2; p++) bound[p] = bound[2 * p < runs ? 2 * p : runs];
+    struct line *x = src; src = dst; dst = x;
+  }
+  if (src != a) memcpy(a, src, n * sizeof(*a));
+}
+
+// apply cmd ("sort [-nru]", "uniq", "keep TEXT", "drop TEXT") to the
+// lines in [from, to); returns the new end of the range, -1 on error
+int line_op(char *buf, int *len, int from, int to, const char *cmd) {
+  int keep = -1, trailing = to > from && buf[to - 1] == '\n', bad = 0;
+  const char *pat = NULL;
+  lines_flags = 0;
+  if (!strncmp(cmd, "sort", 4) && (!cmd[4] || cmd[4] == ' ')) {
+    for (const char *c = cmd + 4; *c && !bad; ) {  // -n, -r, -u, apart or together
+      while (*c == ' ') c++;
+      if (!*c) break;
+      bad = *c++ != '-' || !*c || *c == ' ';
+      for (; *c && *c != ' '; c++) {
+        if (*c == 'n') lines_flags |= LINES_NUMERIC;
+        else if (*c == 'r') lines_flags |= LINES_REVERSE;
+        else if (*c == 'u') lines_flags |= LINES_UNIQUE;
+        else bad = 1;
+      }
+    }
+  } else if (!strcmp(cmd, "uniq")) {
+    lines_flags = LINES_UNIQUE;
+  } else if (!strncmp(cmd, "keep ", 5) || !strncmp(cmd, "drop ", 5)) {
+    keep = cmd[0] == 'k';
+    pat = cmd + 5;
+  } else {
+    bad = 1;
+  }
+  if (bad) {
+    snprintf(status_msg, sizeof(status_msg), "sort [-nru] | uniq | keep TEXT | drop TEXT");
+    return -1;
+  }
+
+  long n = 0;
+  for (char *p = buf + from; p < buf + to; n++) {
+    char *nl = memchr(p, '\n', buf + to - p);
+    p = nl ? nl + 1 : buf + to;
+  }
+  struct line *lines = malloc((n + 1) * sizeof(*lines));
+  struct line *tmp = keep < 0 ? malloc((n + 1) * sizeof(*lines)) : NULL;
+  if (!lines || (keep < 0 && !tmp)) {
+    free(lines);
+    free(tmp);
+    snprintf(status_msg, sizeof(status_msg), "out of memory");
+    return -1;
+  }
+
+  lines_buf = buf;
+  long m = 0, size = 0;
+  for (int p = from; p < to; ) {
+    char *nl = memchr(buf + p, '\n', to - p);
+    int end = nl ? nl - buf : to;
+    struct line l = { 0, p, end - p };
+    p = end + 1;
+    if (pat && (memmem(buf + l.start, l.len, pat, strlen(pat)) != NULL) != keep) continue;
+    if (!pat) l.key = line_key(buf + l.start, l.len);
+    lines[m++] = l;
+  }
+  if (!pat && cmd[0] == 's') parallel_sort(lines, tmp, m);
+  if (lines_flags & LINES_UNIQUE) {
+    long k = 0;
+    for (long i = 0; i < m; i++) {
+      if (k > 0 && !line_cmp(&lines[i], &lines[k - 1])) continue;  // equal as the sort sees them
+      lines[k++] = lines[i];
+    }
+    m = k;
+  }
+  for (long i = 0; i < m; i++) size += lines[i].len + 1;
+  if (m && !trailing) size--;
+
+  struct clip *after = clip_new(NULL, size, 0);
+  if (after && after->len == size) {
+    char *out = after->data;
+    for (long i = 0; i < m; i++) {
+      memcpy(out, buf + lines[i].start, lines[i].len);
+      out += lines[i].len;
+      if (i < m - 1 || trailing) *out++ = '\n';
+    }
+    record_clips(from, clip_new(buf + from, to - from, 1), after);
+    replace_text(buf, len, from, to - from, after->data, size);
+    snprintf(status_msg, sizeof(status_msg), "%ld lines -> %ld", n, m);
+  } else {
+    clip_unref(after);
+    snprintf(status_msg, sizeof(status_msg), "out of memory");
+    size = -1;
+  }
+  free(lines);
+  free(tmp);
+  return size < 0 ? -1 : from + size;
+}
+
+// frame buffer: a whole frame is built here and written with one fwrite
+char *frame;
+int frame_len = 0, frame_cap = 0;
+
+void out(const char *s, int n) {
+  if (frame_len + n > frame_cap) {
+    frame_cap = (frame_len + n) * 2 + 4096;
+    frame = realloc(frame, frame_cap);
+  }
+  memcpy(frame + frame_len, s, n);
+  frame_len += n;
+}
+
+void outs(const char *s) {
+  out(s, strlen(s));
+}
+
+void outf(const char *fmt, ...) {
+  char tmp[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  out(tmp, n < (int)sizeof(tmp) ? n : (int)sizeof(tmp) - 1);
+}
+
+void out_flush() {
+  fwrite(frame, 1, frame_len, stdout);
+  frame_len = 0;
+}
+
+// turn runs of one character into REP
+void rep_pack(int from) {
+  int w = from;
+  for (int i = from; i < frame_len; ) {
+    unsigned char c = frame[i];
+    if (c == 27) {  // copy escape sequences as they are
+      int j = i + 1;
+      if (j < frame_len && frame[j] == '[')
+        for (j++; j < frame_len && (frame[j] < 0x40 || frame[j] > 0x7e); j++) {}
+      j = j < frame_len ? j + 1 : j;
+      while (i < j) frame[w++] = frame[i++];
+      continue;
+    }
+    int n = 1;
+    while (c >= 0x20 && c < 0x7f && i + n < frame_len && frame[i + n] == c) n++;
+    frame[w++] = c;
+    if (n >= 8) w += sprintf(frame + w, "\033[%db", n - 1);
+    else for (int k = 1; k < n; k++) frame[w++] = c;
+    i += n;
+  }
+  frame_len = w;
+}
+
+// drop the row just built if the screen already shows it; body is where
+// the row starts after its cursor move, so a row that only moved matches
+void row_done(unsigned long long *seen, int mark, int body) {
+  if (term_caps & CAP_REP) rep_pack(body);
+  unsigned long long h = 14695981039346656037ULL;
+  for (int i = body; i < frame_len; i++) h = (h ^ (unsigned char)frame[i]) * 1099511628211ULL;
+  if (*seen == h) frame_len = mark;
+  else *seen = h;
+}
+
+void draw_status(const char *msg) {
+  char status_line[term_cols + 1];
+  char which[32] = "", lines[32] = "";
+  if (nbufs > 1) snprintf(which, sizeof(which), " [%d/%d]", cur_buf + 1, nbufs);
+  if (total_lines >= 0) snprintf(lines, sizeof(lines), " (%d lines)", total_lines);
+  snprintf(status_line, term_cols + 1, "file:%s%s%s  %s", filename ? filename : "[senza nome]", which, lines, msg);
+  int mark = frame_len;
+  outf("\033[%d;1H", term_rows);
+  int body = frame_len;
+  outs("\033[7m");
+  outf("%-*.*s", term_cols, term_cols, status_line);
+  outs("\033[0m");
+  row_done(&status_hash, mark, body);
+}
+
+// hex view: row r always starts at byte r * 16, so no scan is needed
+void draw_hex(char *buf, int len, int pos) {
+  static const char hex[] = "0123456789abcdef";
+  int rows = term_rows - 1;
+  int row = pos / 16;
+
+  if (row < scroll) scroll = row;
+  else if (row >= scroll + rows) scroll = row - rows + 1;
+
+  outs("\033[H");
+  for (int y = 0; y < rows; y++) {
+    long off = (long)(scroll + y) * 16;
+    if (off > len || (off == len && scroll + y != row)) {
+      outs("\033[K\r\n");
+      continue;
+    }
+    char line[128];
+    int cnt = len - off < 16 ? len - off : 16;
+
+    memset(line, ' ', 78);
+    for (int j = 0; j < cnt; j++) {
+      unsigned char c = buf[off + j];
+      int x = j * 3 + (j >= 8);
+      line[x] = hex[c >> 4];
+      line[x + 1] = hex[c & 15];
+      line[50 + j] = (c >= 32 && c < 127) ? c : '.';
+    }
+    outf("\033[48;5;236;38;5;250m%08lx │\033[0m ", off);
+    out(line, 50 + cnt);
+    outs("\033[K\r\n");
+  }
+
+  char msg[128];
+  snprintf(msg, sizeof(msg), "%s  HEX 0x%x/0x%x", status_msg, pos, len);
+  draw_status(msg);
+
+  outf("\033[%d;%dH", row - scroll + 1, 12 + (pos % 16) * 3 + (pos % 16 >= 8) + hex_nibble);
+  outs("\033[?25h");
+  if (term_caps & CAP_SYNC) outs("\033[?2026l");
+  out_flush();
+}
+
+
+unsigned long long divider_hash;
+int view_cap = 0;  // rows allocated in each view's row arrays
+
+// forget what the screen shows, e.g. after something else drew on it
+void screen_reset() {
+  for (int k = 0; k < 2; k++) {
+    if (view_cap) memset(views[k].row_hash, 0, view_cap * sizeof(unsigned long long));
+    views[k].top = -1;
+  }
+  divider_hash = status_hash = 0;
+}
+
+// place the views for the current split and terminal size
+void layout() {
+  static int last_rows, last_cols, last_split = -1;
+  int text = term_rows - 1;
+  int mode = (split == 1 && text >= 3) || (split == 2 && term_cols >= 20) ? split : 0;
+
+  if (term_rows != last_rows || term_cols != last_cols || split != last_split) {
+    if (term_rows > view_cap) {
+      view_cap = term_rows;
+      for (int k = 0; k < 2; k++) {
+        views[k].row_vis = realloc(views[k].row_vis, view_cap * sizeof(int));
+        views[k].row_col = realloc(views[k].row_col, view_cap * sizeof(int));
+        views[k].row_hash = realloc(views[k].row_hash, view_cap * sizeof(unsigned long long));
+      }
+    }
+    last_rows = term_rows;
+    last_cols = term_cols;
+    last_split = split;
+    screen_reset();
+  }
+
+  nviews = mode ? 2 : 1;
+  views[0].y = views[0].x = 1;
+  views[0].rows = text;
+  views[0].cols = term_cols;
+  if (mode == 1) {
+    views[0].rows = (text - 1) / 2;
+    views[1].y = views[0].rows + 2;
+    views[1].x = 1;
+    views[1].rows = text - views[0].rows - 1;
+    views[1].cols = term_cols;
+  } else if (mode == 2) {
+    views[0].cols = (term_cols - 1) / 2;
+    views[1].y = 1;
+    views[1].x = views[0].cols + 2;
+    views[1].rows = text;
+    views[1].cols = term_cols - views[0].cols - 1;
+  }
+}
+
+// finish a row: clear to the edge, or pad up to the separator column
+void row_tail(struct view *v, int shown) {
+  outs("\033[0m");
+  if (v->x + v->cols > term_cols) {
+    outs("\033[K");
+    return;
+  }
+  if ((term_caps & CAP_ECH) && v->cols - shown > 8) outf("\033[%dX\033[%dC", v->cols - shown, v->cols - shown);
+  else for (int i = shown; i < v->cols; i++) out(" ", 1);
+  outs("\033[48;5;236;38;5;250m│\033[0m");
+}
+
+// bracket under the cursor and its match, underlined by draw_line
+int pair_a = -1, pair_b = -1;
+
+// one screen row: gutter, then the visible part of buf[start, end) with
+// one SGR span per run of characters sharing the same attribute; the row
+// map keeps the first visible byte and its column for mouse clicks.
+// folded is the number of lines hidden under this one, mark its diff state
+void draw_line(char *buf, int len, struct view *v, int start, int end, int number, int folded, char mark, int sel_from, int sel_to) {
+  const char *cur = "", *kw_color = NULL;
+#if ZT_HIGHLIGHT
+  int kw_end = start;
+#else
+  (void)len;
+#endif
+  int visual_col = 0, width = v->cols - 6, shown = 6;
+  int hscroll = v->hscroll, row = v->rows_drawn;
+
+  v->row_vis[row] = -1;
+
+  const char *color = mark == '+' ? "\033[38;5;71m" : mark == '~' ? "\033[38;5;179m" : mark == '-' ? "\033[38;5;167m" : "";
+  const char *sep = folded ? "▸" : mark == '+' ? "+" : mark == '~' ? "~" : mark == '-' ? "‾" : "│";
+  outf("\033[48;5;236;38;5;250m%4d %s%s\033[0m", number, color, sep);
+  for (int i = start; i < end && visual_col - hscroll < width; ) {
+#if ZT_HIGHLIGHT
+    if (i >= kw_end) {
+      const char *word;
+      int delta = match_keyword(buf, i, len, &kw_color, &word);
+      if (!delta) kw_color = NULL;
+      kw_end = i + (delta ? delta : 1);
+    }
+#endif
+
+    int w, clen = utf8_step(buf + i, end - i, &w);
+    if (visual_col >= hscroll && v->row_vis[row] < 0) {
+      v->row_vis[row] = i;
+      v->row_col[row] = visual_col;
+    }
+    if (visual_col - (w == 0) >= hscroll && visual_col + w - hscroll <= width) {
+      const char *attr = (i >= sel_from && i < sel_to) ? "\033[7m" :
+                         (i == pair_a || i == pair_b) ? "\033[1;4m" : kw_color ? kw_color : "";
+      if (strcmp(attr, cur)) {
+        outs("\033[0m");
+        outs(attr);
+        cur = attr;
+      }
+      out(buf + i, clen);
+      shown += w;
+    }
+    visual_col += w;
+    i += clen;
+  }
+  if (v->row_vis[row] < 0) {
+    v->row_vis[row] = end;
+    v->row_col[row] = hscroll;
+  }
+  if (folded) {
+    char tag[32];
+    int n = snprintf(tag, sizeof(tag), " … %d line%s", folded, folded > 1 ? "s" : "");
+    if (shown + n - 2 <= v->cols) {  // … is one column
+      outs("\033[0m\033[38;5;244m");
+      outs(tag);
+      shown += n - 2;
+    }
+  }
+  v->rows_drawn++;
+  row_tail(v, shown);
+}
+
+// buffer offset under the mouse, from the row map of the last frame;
+// a click in the other view moves the focus there first
+int mouse_pos(char *buf, int len) {
+  if (!mouse_drag) {
+    for (int k = 0; k < nviews; k++) {
+      struct view *v = &views[k];
+      if (k != cur_view && mouse_y >= v->y && mouse_y < v->y + v->rows &&
+          mouse_x >= v->x && mouse_x < v->x + v->cols) {
+        views[cur_view].scroll = scroll;
+        views[cur_view].hscroll = hscroll;
+        cur_view = k;
+        scroll = v->scroll;
+        hscroll = v->hscroll;
+        sel_mode = 0;
+      }
+    }
+  }
+  struct view *v = &views[cur_view];
+  int y = mouse_y - v->y;
+  if (v->rows_drawn == 0) return len;
+  if (y >= v->rows_drawn) y = v->rows_drawn - 1;
+  if (y < 0) y = 0;
+  int col = mouse_x - v->x - 6 + hscroll - v->row_col[y];
+  return col_to_pos(buf, len, v->row_vis[y], col < 0 ? 0 : col);
+}
+
+void draw_view(char *buf, int len, struct view *v, int sel_from, int sel_to) {
+  int l = line_of(buf, len, v->pos);
+  int col = utf8_cols(buf, line_start(buf, len, v->pos), v->pos);
+  int width = v->cols - 6;
+
+  // scroll stays a line number; folds only change how rows map to lines
+  fold_reveal(l);
+  int row = fold_row(l), top = fold_row(v->scroll);
+  if (row < top) top = row;
+  else if (row >= top + v->rows) top = row - v->rows + 1;
+  v->scroll = fold_line(top);
+
+  if (col < v->hscroll) v->hscroll = col;
+  else if (col >= v->hscroll + width) v->hscroll = col - width + 1;
+
+  // a full-width view that scrolled a little: let the terminal move the
+  // rows that stay, and their hashes with them, so only new rows are sent
+  int d = top - v->top;
+  if ((term_caps & CAP_SCROLL) && v->top >= 0 && d && abs(d) < v->rows && v->cols == term_cols) {
+    unsigned long long *h = v->row_hash;
+    outf("\033[0m\033[%d;%dr\033[%d;1H\033[%d%c\033[r", v->y, v->y + v->rows - 1, v->y, abs(d), d > 0 ? 'M' : 'L');
+    if (d > 0) {
+      memmove(h, h + d, (v->rows - d) * sizeof(*h));
+      memset(h + v->rows - d, 0, d * sizeof(*h));
+    } else {
+      memmove(h - d, h, (v->rows + d) * sizeof(*h));
+      memset(h, 0, -d * sizeof(*h));
+    }
+  }
+  v->top = top;
+
+  v->rows_drawn = 0;
+  int line = v->scroll, start = line_offset(buf, len, line);
+  for (int y = 0; y < v->rows; y++) {
+    int mark = frame_len;
+    outf("\033[%d;%dH", v->y + y, v->x);
+    int body = frame_len;
+    if (start > len) {  // past the last line
+      row_tail(v, 0);
+    } else {
+      int end = line_end(buf, len, start);
+      int k = fold_hidden(line + 1), folded = k >= 0 ? fx.h[k].to - line : 0;
+#if ZT_GUTTER
+      char mark = gutter_mark(line);
+#else
+      char mark = 0;
+#endif
+      draw_line(buf, len, v, start, end, line + 1, folded, mark, sel_from, sel_to);
+      if (folded) end = line_end(buf, len, line_offset(buf, len, fx.h[k].to));
+      line += folded + 1;
+      start = end + 1;
+    }
+    row_done(&v->row_hash[y], mark, body);
+  }
+  v->cy = v->y + row - top;
+  v->cx = v->x + 6 + col - v->hscroll;
+}
+
+#if ZT_COMPLETE
+// completion popup: candidates listed under the word being completed
+struct word popup[8];
+int popup_n = 0, popup_sel = 0, popup_cols = 0;  // cols: prefix width
+
+void draw_popup(struct view *v) {
+  int w = 0;
+  for (int i = 0; i < popup_n; i++) if (popup[i].len > w) w = popup[i].len;
+  int x = v->cx - popup_cols, y = v->cy + 1;
+  if (y + popup_n > v->y + v->rows && v->cy - popup_n >= v->y) y = v->cy - popup_n;  // no room below
+  if (x + w + 2 > term_cols) x = term_cols - w - 2;
+  if (x < 1) x = 1;
+  for (int i = 0; i < popup_n && y + i < term_rows; i++) {
+    outf("\033[%d;%dH%s %-*.*s \033[0m", y + i, x, i == popup_sel ? "\033[48;5;31;38;5;231m" : "\033[48;5;238;38;5;252m",
+         w, popup[i].len, wx->arena + popup[i].off);
+    for (int k = 0; k < nviews; k++)  // so the rows under it are drawn again
+      if (y + i >= views[k].y && y + i < views[k].y + views[k].rows) views[k].row_hash[y + i - views[k].y] = 0;
+    if (nviews == 2 && y + i == views[1].y - 1) divider_hash = 0;
+  }
+}
+#endif
+
+void draw(char *buf, int len, int pos) {
+  if (playing) return;  // one frame at the end
+#if ZT_GUTTER
+  gutter_poll(buf);
+#endif
+  line_index_poll();
+  if (total_lines < 0 && (ZT_THREADS || len < 1 << 20)) line_index_start(buf, len);  // the line count
+  if (term_caps & CAP_SYNC) outs("\033[?2026h");  // the terminal shows the frame only once it is whole
+  outs("\033[?25l");  // hide cursor
+  get_terminal_size();
+  if (hex_mode) {
+    screen_reset();
+    draw_hex(buf, len, pos);
+    return;
+  }
+  layout();
+
+  int sel_from = -1, sel_to = -1;
+  if (sel_mode) {
+    sel_from = pos < sel_anchor ? pos : sel_anchor;
+    sel_to   = pos > sel_anchor ? pos : sel_anchor;
+  }
+
+  pair_a = pair_b = -1;
+  if (bx.built || len <= 16 << 20) {  // huge files only once asked to
+    int k = brk_at(buf, len, pos);
+    int m = k >= 0 ? brk_match(k) : -1;
+    if (m >= 0) {
+      pair_a = brk_pos(k);
+      pair_b = brk_pos(m);
+    }
+  }
+
+  struct view *v = &views[cur_view];
+  v->pos = pos;
+  v->scroll = scroll;
+  v->hscroll = hscroll;
+  for (int k = 0; k < nviews; k++) draw_view(buf, len, &views[k], sel_from, sel_to);
+  scroll = v->scroll;
+  hscroll = v->hscroll;
+
+  if (nviews == 2 && views[1].x == 1) {  // stacked: a rule between the views
+    int mark = frame_len;
+    outf("\033[%d;1H", views[1].y - 1);
+    int body = frame_len;
+    outs("\033[38;5;240m");
+    for (int i = 0; i < term_cols; i++) outs("─");
+    outs("\033[0m");
+    row_done(&divider_hash, mark, body);
+  }
+
+#if ZT_COMPLETE
+  if (popup_n) draw_popup(v);
+#endif
+
+  // Status bar
+  draw_status(status_msg);
+
+  // cursor position
+  outf("\033[%d;%dH", v->cy, v->cx);
+  outs("\033[?25h");  // show cursor
+  if (term_caps & CAP_SYNC) outs("\033[?2026l");
+  out_flush();
+}
+
+// filter: run cmd through /bin/sh with the range [from, to) on its stdin
+// and replace the range with its stdout. Everything goes through one
+// poll loop, so a child that writes before it has read all its input
+// can't deadlock us on full pipes; Esc kills it
+extern char **environ;
+
+static void pipe_progress(long sent, long total, long got) {
+  char msg[96];
+  snprintf(msg, sizeof(msg), "piping: %ld/%ld KB in, %ld KB out (Esc cancels)", sent >> 10, total >> 10, got >> 10);
+  draw_status(msg);
+  out_flush();
+  fflush(stdout);
+}
+
+// returns the new end of the range, -1 if nothing was replaced
+int pipe_range(char *buf, int *len, int from, int to, const char *cmd) {
+  int in[2], out[2], err[2];
+  if (pipe(in)) return -1;
+  if (pipe(out)) { close(in[0]); close(in[1]); return -1; }
+  if (pipe(err)) { close(in[0]); close(in[1]); close(out[0]); close(out[1]); return -1; }
+
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+  posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+  posix_spawn_file_actions_adddup2(&fa, err[1], 2);
+  int fds[] = { in[0], in[1], out[0], out[1], err[0], err[1] };
+  for (int i = 0; i < 6; i++) posix_spawn_file_actions_addclose(&fa, fds[i]);
+
+  posix_spawnattr_t attr;
+  sigset_t def;
+  posix_spawnattr_init(&attr);
+  sigemptyset(&def);
+  sigaddset(&def, SIGINT);
+  sigaddset(&def, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &def);
+  posix_spawnattr_setpgroup(&attr, 0);  // Esc must reach the whole pipeline
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+  pid_t pid;
+  char *argv[] = { "sh", "-c", (char *)cmd, NULL };
+  int failed = posix_spawn(&pid, "/bin/sh", &fa, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  if (failed) {
+    close(in[1]); close(out[0]); close(err[0]);
+    snprintf(status_msg, sizeof(status_msg), "cannot run /bin/sh");
+    return -1;
+  }
+
+  void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+  fcntl(err[0], F_SETFL, O_NONBLOCK);
+
+  long sent = 0, total = to - from, got = 0, cap = total + 4096;
+  char *res = malloc(cap), errmsg[64] = "";
+  int errlen = 0, cancel = !res, wfd = in[1], rfd = out[0], efd = err[0];
+  if (!total) { close(wfd); wfd = -1; }
+  struct timeval t0, now;
+  gettimeofday(&t0, NULL);
+
+  while (!cancel && (rfd >= 0 || efd >= 0)) {
+    struct pollfd p[4] = { { 0, POLLIN, 0 }, { wfd, POLLOUT, 0 }, { rfd, POLLIN, 0 }, { efd, POLLIN, 0 } };
+    int n = poll(p, 4, 100);
+    if (n < 0 && errno != EINTR) break;
+
+    if (p[0].revents & POLLIN) {  // a lone Esc cancels, other keys are dropped
+      int c;
+      while ((c = in_getc_now()) != -1)
+        if (c == 27 && in_getc_now() == -1) cancel = 1;
+    }
+    if (wfd >= 0 && p[1].revents) {
+      long w = -1;
+#ifdef __linux__
+      struct iovec iov = { buf + from + sent, total - sent };
+      w = vmsplice(wfd, &iov, 1, SPLICE_F_NONBLOCK);  // map the pages, no copy
+      if (w < 0 && errno != EAGAIN)
+#endif
+      w = write(wfd, buf + from + sent, total - sent);
+      if (w > 0) sent += w;
+      if (sent == total || (w < 0 && errno != EAGAIN)) {  // done, or the child stopped reading
+        close(wfd);
+        wfd = -1;
+      }
+    }
+    if (rfd >= 0 && p[2].revents) {
+      if (got == cap) {
+        char *r = realloc(res, cap *= 2);
+        if (!r) { cancel = 1; break; }
+        res = r;
+      }
+      long r = read(rfd, res + got, cap - got);
+      if (r > 0) got += r;
+      else if (r == 0 || errno != EAGAIN) { close(rfd); rfd = -1; }
+    }
+    if (efd >= 0 && p[3].revents) {
+      char tmp[4096];
+      long r = read(efd, tmp, sizeof(tmp));
+      if (r > 0 && errlen < (int)sizeof(errmsg) - 1) {
+        int k = r < (int)sizeof(errmsg) - 1 - errlen ? r : (int)sizeof(errmsg) - 1 - errlen;
+        memcpy(errmsg + errlen, tmp, k);
+        errlen += k;
+        errmsg[errlen] = 0;
+      } else if (r == 0 || (r < 0 && errno != EAGAIN)) {
+        close(efd);
+        efd = -1;
+      }
+    }
+
+    gettimeofday(&now, NULL);
+    if ((now.tv_sec - t0.tv_sec) * 1000 + (now.tv_usec - t0.tv_usec) / 1000 >= 100) {
+      pipe_progress(sent, total, got);
+      t0 = now;
+    }
+  }
+
+  if (cancel) kill(-pid, SIGTERM);
+  if (wfd >= 0) close(wfd);
+  if (rfd >= 0) close(rfd);
+  if (efd >= 0) close(efd);
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+  signal(SIGPIPE, old_pipe);
+
+  char *nl = strchr(errmsg, '\n');
+  if (nl) *nl = 0;
+  if (cancel) {
+    snprintf(status_msg, sizeof(status_msg), res ? "pipe cancelled" : "out of memory");
+  } else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+    snprintf(status_msg, sizeof(status_msg), "exit %d: %s", WIFEXITED(status) ? WEXITSTATUS(status) : -1, errmsg);
+  } else if (*len - total + got >= buf_cap) {
+    snprintf(status_msg, sizeof(status_msg), "output too large");
+  } else {
+    struct clip *after = clip_new(NULL, 0, 0);  // takes over the output
+    if (after) {
+      free(after->data);
+      after->data = res;
+      after->len = got;
+      record_clips(from, clip_new(buf + from, total, 1), after);
+      replace_text(buf, len, from, total, res, got);
+      snprintf(status_msg, sizeof(status_msg), "%ld bytes -> %ld", total, got);
+      return from + got;
+    }
+    snprintf(status_msg, sizeof(status_msg), "out of memory");
   }
-  return c; 
+  free(res);
+  return -1;
 }
 
-int line_start(char *buf, int len, int pos) {
-  while (pos > 0 && buf[pos - 1] != '\n') pos--;
-  return pos;
-}
+// write only the dirty ranges and the appended tail, in place
+int patch_save(char *buf, int len) {
+  int fd = open(filename, O_WRONLY);
+  if (fd == -1) return 0;
+
+  long written = 0;
+  int ok = 1;
+  for (int i = 0; i < dirty_count && ok; i++) {
+    int n = dirty[i].to - dirty[i].from;
+    ok = pwrite(fd, buf + dirty[i].from, n, dirty[i].from) == n;
+    written += n;
+  }
+  if (ok && len > disk_len) {
+    int n = len - disk_len;
+    ok = pwrite(fd, buf + disk_len, n, disk_len) == n;
+    written += n;
+  }
+  if (ok) ok = fsync(fd) == 0;
+  close(fd);
 
-int line_end(char *buf, int len, int pos) {
-  while (pos < len && buf[pos] != '\n') pos++;
-  return pos;
+  if (!ok) {
+    snprintf(status_msg, sizeof(status_msg), "Save error");
+    return 1;
+  }
+  snprintf(status_msg, sizeof(status_msg), "Saved in %s (%ld/%d byte written)", filename, written, len);
+  mark_clean(len);
+  return 1;
 }
 
-int move_vert(char *buf, int len, int pos, int dir) {
-  int start = line_start(buf, len, pos);
-  int col = pos - start;
-  int new_start;
-
-  if (dir < 0 && start > 0) new_start = line_start(buf, len, start - 1);
-  else if (dir > 0 && line_end(buf, len, pos) < len) new_start = line_end(buf, len, pos) + 1;
-  else return pos;
-
-  int new_end = line_end(buf, len, new_start);
-  int new_len = new_end - new_start;
-  if (col > new_len) col = new_len;
-  return new_start + col;
-}
+// write a sibling temp file and rename it over the original
+int atomic_save(char *buf, int len) {
+  char path[PATH_MAX], tmpname[PATH_MAX + 16];
+  struct stat st;
+  int exists = stat(filename, &st) == 0;
 
-void draw(char *buf, int len, int pos) {
-  printf("\033[?25l");  // hide cursor
-  get_terminal_size();
+  if (exists && (access(filename, W_OK) != 0 || st.st_nlink > 1 || st.st_uid != geteuid()))
+    return 0;  // rename would break permissions, links or ownership
+  if (!realpath(filename, path)) snprintf(path, sizeof(path), "%s", filename);
 
-  int sel_from = -1, sel_to = -1;
-  if (sel_mode) {
-    sel_from = pos < sel_anchor ? pos : sel_anchor;
-    sel_to   = pos > sel_anchor ? pos : sel_anchor;
+  snprintf(tmpname, sizeof(tmpname), "%s.ztXXXXXX", path);
+  int fd = mkstemp(tmpname);
+  if (fd == -1) return 0;
+  if (exists && fchown(fd, -1, st.st_gid)) {  // not one of our groups: keep it by writing in place
+    close(fd);
+    unlink(tmpname);
+    return 0;
   }
 
-  printf("\033[H"); // home
+  mode_t mask = umask(0);
+  umask(mask);
+  fchmod(fd, exists ? (st.st_mode & 07777) : (0666 & ~mask));
 
-  int line = 0, y = 0;
-  int show_line = scroll;
-  int new_line = 1;
-
-  int cx = 1, cy = 1;
-  int l = 0, col = 0;
+  int ok = 1;
+  for (int off = 0; ok && off < len; ) {
+    int n = write(fd, buf + off, len - off);
+    if (n <= 0) ok = 0;
+    else off += n;
+  }
+  if (ok) ok = fsync(fd) == 0;
+  close(fd);
+  if (ok) ok = rename(tmpname, path) == 0;
+  if (!ok) {
+    unlink(tmpname);
+    snprintf(status_msg, sizeof(status_msg), "Save error");
+    return 1;
+  }
+  snprintf(status_msg, sizeof(status_msg), "Saved in %s (%d/%d byte written)", filename, len, len);
+  mark_clean(len);
+  return 1;
+}
 
-  for (int i = 0; i < pos && i < len; ) {
-    int clen = utf8_charlen(buf[i]);
-    if (buf[i] == '\n') {
-      l++;
-      col = 0;
-    } else {
-      col++;
+// --ztwrite PATH: the root half of a sudo save. It says it is running,
+// skips stdin up to the marker line (sudo may have left the password
+// there) and streams exactly the announced bytes into a temp file beside
+// path, which then replaces it with the old owner and mode. A file with
+// other hard links is overwritten instead, but only once the whole text
+// has arrived; if that copy fails the temp file is kept and named on
+// stderr
+#define ZTWRITE_MARK "--ztwrite--"
+
+int ztwrite(const char *target) {
+  char path[PATH_MAX], tmpname[PATH_MAX + 16], line[64];
+  struct stat st;
+  if (!realpath(target, path)) snprintf(path, sizeof(path), "%s", target);
+  int exists = stat(path, &st) == 0;
+  if (write(1, "+", 1) != 1) return 1;
+
+  long expect = -1;
+  for (int n = 0; expect < 0; ) {
+    char c;
+    if (read(0, &c, 1) != 1) return 1;
+    if (c != '\n') {
+      if (n < (int)sizeof(line) - 1) line[n++] = c;
+      continue;
     }
-    i += clen;
+    line[n] = 0;
+    n = 0;
+    if (!strncmp(line, ZTWRITE_MARK " ", sizeof(ZTWRITE_MARK))) expect = atol(line + sizeof(ZTWRITE_MARK));
   }
 
-  if (l < scroll) scroll = l;
-  else if (l >= scroll + term_rows - 1) scroll = l - term_rows + 2;
-
-  if (col < hscroll) hscroll = col;
-  else if (col >= hscroll + term_cols - 6) hscroll = col - (term_cols - 6) + 1;
-
-  for (int i = 0; i < len && y < term_rows - 1; ) {
-    if (line >= scroll) {
-      static int visual_col = 0;
-      if (new_line) {
-        visual_col = 0;
-        printf("\033[K\033[48;5;236;38;5;250m%4d │\033[0m", show_line + 1);
-        new_line = 0;
-      }
-
-      int clen = utf8_charlen(buf[i]);
-      int selected = (sel_mode && i >= sel_from && i < sel_to);
-      const char *kw_color, *kw_word;
-      int delta = match_keyword(buf, i, len, &kw_color, &kw_word);
-
-      if (delta > 0) {
-        for (int j = 0; j < delta && i + j < len; ) {
-          int chlen = utf8_charlen(buf[i + j]);
-          int selected = (sel_mode && i + j >= sel_from && i + j < sel_to);
-
-          if (visual_col >= hscroll && visual_col - hscroll < term_cols - 6) {
-            if (selected)
-              printf("\033[7m");
-            else
-              printf("%s", kw_color);
-            fwrite(buf + i + j, 1, chlen, stdout);
-            printf("\033[0m");
-          }
-          visual_col++;
-          j += chlen;
-        }
-        i += delta;
-        if (i == len) {
-          printf("\033[0m\r\n");
-          y++;
-          show_line++;
-          new_line = 0;
-        }
-        continue;
-      }
+  int in_place = exists && st.st_nlink > 1;  // renaming would break the links
+  snprintf(tmpname, sizeof(tmpname), "%s.ztXXXXXX", path);
+  int fd = mkstemp(tmpname);
+  if (fd == -1) return 1;
+  if (!in_place) {
+    mode_t mask = umask(0);
+    umask(mask);
+    if (exists && fchown(fd, st.st_uid, st.st_gid)) {}  // first: it clears setuid and setgid
+    fchmod(fd, exists ? (st.st_mode & 07777) : (0666 & ~mask));
+  }
 
-      if (buf[i] == '\n') {
-        printf("\033[0m\r\n");
-        y++;
-        show_line++;
-        new_line = 1;
-        line++;
-        i += clen;
-      } else {
-        new_line = 0;
-        if (visual_col >= hscroll && visual_col - hscroll < term_cols - 6) {
-          if (selected) printf("\033[7m");
-          fwrite(buf + i, 1, clen, stdout);
-          if (selected) printf("\033[0m");
-        }
-        visual_col++;
-        i += clen;
-        if (i == len) {
-          printf("\033[0m\r\n");
-          y++;
-          show_line++;
-        }
-      }
-    } else {
-      int clen = utf8_charlen(buf[i]);
-      if (buf[i] == '\n') {
-        line++;
+  static char chunk[BUF_SIZE];
+  long got = 0;
+  int ok = 1;
+  for (int n; ok && (n = read(0, chunk, sizeof(chunk))) != 0; ) {
+    if (n < 0) { ok = errno == EINTR; continue; }
+    got += n;
+    for (int off = 0; ok && off < n; ) {
+      int w = write(fd, chunk + off, n - off);
+      if (w <= 0) ok = 0;
+      else off += w;
+    }
+  }
+  ok = ok && got == expect && fsync(fd) == 0;  // a short stream never replaces the file
+  if (ok && in_place) {
+    int out = open(path, O_WRONLY), copied = out >= 0 && lseek(fd, 0, SEEK_SET) == 0;
+    for (int n; copied && (n = read(fd, chunk, sizeof(chunk))) != 0; ) {
+      if (n < 0) { copied = errno == EINTR; continue; }
+      for (int off = 0; copied && off < n; ) {
+        int w = write(out, chunk + off, n - off);
+        if (w <= 0) copied = 0;
+        else off += w;
       }
-      i += clen;
+    }
+    copied = copied && ftruncate(out, got) == 0 && fsync(out) == 0;
+    if (out >= 0 && close(out)) copied = 0;
+    if (!copied) {
+      close(fd);
+      fprintf(stderr, "kept in %s\n", tmpname);
+      return 1;
     }
   }
+  close(fd);
+  if (!in_place && ok) ok = rename(tmpname, path) == 0;
+  if (in_place || !ok) unlink(tmpname);
+  return !ok;
+}
 
-
-  if (buf[len - 1] == '\n' && y < term_rows - 1 && scroll + y >= line){
-      printf("\033[K\033[48;5;236;38;5;250m%4d │\033[0m\r\n", show_line+1 );
-      y++;
+// save through "sudo zt --ztwrite": the password and then the text go
+// down one pipe, no shell and no copy on disk. The text is only sent
+// once the helper runs, so a wrong password can't eat lines of it as
+// new attempts; sudo's complaint on stderr ends the wait
+void sudo_save(char *buf, int len) {
+  char self[PATH_MAX], password[128] = "";
+  int n = readlink("/proc/self/exe", self, sizeof(self) - 1);  // sudo's own /proc/self is sudo
+  if (n <= 0) {
+    snprintf(status_msg, sizeof(status_msg), "Save failed (no /proc/self/exe)");
+    return;
   }
-  printf("\033[J");//delete over lastline
-  
-  // Status bar
-  char status_line[term_cols + 1];
-  snprintf(status_line, term_cols + 1, "file:%s  %s", filename ? filename : "[senza nome]", status_msg);
-  printf("\033[%d;1H\033[7m", term_rows);
-  printf("%-*.*s", term_cols, term_cols, status_line);
-  printf("\033[0m");
+  self[n] = 0;
 
+  get_secret("password: ", password, sizeof(password));
+  snprintf(status_msg, sizeof(status_msg), "🔐 Writing with sudo...");
+  draw(buf, len, 0);
+  fflush(stdout);
 
-  // cursor position
-  cx = col - hscroll + 7;
-  cy = l - scroll + 1;
-  printf("\033[%d;%dH", cy, cx);
-  printf("\033[?25h");  // show cursor
+  int in[2], out[2], err[2];
+  if (pipe(in)) return;
+  if (pipe(out)) { close(in[0]); close(in[1]); return; }
+  if (pipe(err)) { close(in[0]); close(in[1]); close(out[0]); close(out[1]); return; }
+
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, in[0], 0);
+  posix_spawn_file_actions_adddup2(&fa, out[1], 1);
+  posix_spawn_file_actions_adddup2(&fa, err[1], 2);
+  int fds[] = { in[0], in[1], out[0], out[1], err[0], err[1] };
+  for (int i = 0; i < 6; i++) posix_spawn_file_actions_addclose(&fa, fds[i]);
+
+  pid_t pid;
+  char *argv[] = { "sudo", "-k", "-S", "-p", "", "--", self, "--ztwrite", filename, NULL };
+  int failed = posix_spawnp(&pid, "sudo", &fa, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  close(in[0]);
+  close(out[1]);
+  close(err[1]);
+  if (failed) {
+    close(in[1]); close(out[0]); close(err[0]);
+    memset(password, 0, sizeof(password));
+    snprintf(status_msg, sizeof(status_msg), "Save failed (cannot run sudo)");
+    return;
+  }
+
+  void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+  int pl = strlen(password);
+  password[pl++] = '\n';
+  int ok = write(in[1], password, pl) == pl;
+  memset(password, 0, sizeof(password));
+
+  // wait for the helper; after a complaint give it 3s, then take it as a no
+  char errmsg[128] = "";
+  int elen = 0, ready = 0, complained = 0;
+  struct timeval t0, now;
+  while (ok && !ready) {
+    struct pollfd p[3] = { { out[0], POLLIN, 0 }, { err[0], POLLIN, 0 }, { 0, POLLIN, 0 } };
+    if (poll(p, 3, 100) < 0 && errno != EINTR) break;
+    if (p[0].revents) {
+      char c;
+      if (read(out[0], &c, 1) != 1) break;
+      ready = c == '+';
+    }
+    if (p[1].revents) {
+      char tmp[256];
+      int r = read(err[0], tmp, sizeof(tmp));
+      if (r > 0 && !complained) gettimeofday(&t0, NULL);
+      for (int i = 0; i < r && elen < (int)sizeof(errmsg) - 1; i++) errmsg[elen++] = tmp[i];
+      complained = 1;
+    }
+    if (p[2].revents && read_key() == KEY_ESC) break;
+    gettimeofday(&now, NULL);
+    if (complained && (now.tv_sec - t0.tv_sec) * 1000 + (now.tv_usec - t0.tv_usec) / 1000 > 3000) break;
+  }
 
+  if (ready) {
+    char mark[64];
+    int ml = snprintf(mark, sizeof(mark), ZTWRITE_MARK " %d\n", len);
+    ok = write(in[1], mark, ml) == ml;
+    for (int off = 0; ok && off < len; ) {
+      int w = write(in[1], buf + off, len - off);
+      if (w <= 0) ok = 0;
+      else off += w;
+    }
+    close(in[1]);
+    elen = 0;  // what the helper itself says, e.g. where it kept the text
+    for (int r; (r = read(err[0], errmsg + elen, sizeof(errmsg) - 1 - elen)) > 0 && (elen += r) < (int)sizeof(errmsg) - 1; );
+  } else {
+    close(in[1]);
+  }
+  close(out[0]);
+  close(err[0]);
+  int status = 0;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+  signal(SIGPIPE, old_pipe);
+  screen_reset();
+
+  errmsg[elen] = 0;
+  char *nl = strchr(errmsg, '\n');
+  if (nl) *nl = 0;
+  if (ready && ok && WIFEXITED(status) && !WEXITSTATUS(status)) {
+    snprintf(status_msg, sizeof(status_msg), "Saved with sudo: %s (%d byte)", filename, len);
+    mark_clean(len);
+  } else {
+    snprintf(status_msg, sizeof(status_msg), "Save failed (sudo%s%.58s)", *errmsg ? ": " : "", errmsg);
+  }
 }
 
 void save(char *buf, int len) {
   if (!filename) return;
 
+  if (disk_len >= 0 && !reshaped && len >= disk_len && patch_save(buf, len)) return;
+  if (atomic_save(buf, len)) return;
+
   FILE *f = fopen(filename, "w");
   if (f) {
     fwrite(buf, 1, len, f);
     fclose(f);
     snprintf(status_msg, sizeof(status_msg), "Saved in %s", filename);
+    mark_clean(len);
     return;
   }
 
-  if (errno == EACCES || errno == EPERM) {
-    char tmpname[] = "/tmp/ztXXXXXX";
-    int fd = mkstemp(tmpname);
-    if (fd == -1) {
-      snprintf(status_msg, sizeof(status_msg), "Temp file error");
-      return;
-    }
-
-    if (write(fd, buf, len) != len) {
-      close(fd);
-      unlink(tmpname);
-      snprintf(status_msg, sizeof(status_msg), "Write temp file failed");
-      return;
-    }
-    close(fd);
-
-    char password[128] = "";
-    get_input("password: ", password, sizeof(password));
-
-    snprintf(status_msg, sizeof(status_msg), "🔐 Writing with sudo...");
-    draw(buf, len, 0);
-    fflush(stdout);
-
-    char cmd[PATH_MAX + 256];
-    snprintf(cmd, sizeof(cmd),
-      "echo '%s' | sudo -S dd if='%s' of='%s' conv=notrunc status=none",
-      password, tmpname, filename);
-
-    int r = system(cmd);
-
-    if (r == 0) {
-      snprintf(status_msg, sizeof(status_msg), "Saved with sudo: %s", filename);
-    } else {
-      snprintf(status_msg, sizeof(status_msg), "Save failed (sudo)");
-    }
-
-    unlink(tmpname);
-  } else {
-    snprintf(status_msg, sizeof(status_msg), "Save error");
-  }
+  if (errno == EACCES || errno == EPERM) sudo_save(buf, len);
+  else snprintf(status_msg, sizeof(status_msg), "Save error");
 }
 
 void delete_selection(char *buf, int *len, int *pos) {
@@ -666,35 +3990,254 @@ void delete_selection(char *buf, int *len, int *pos) {
 
   if (count > 0) {
     record_change(start, buf + start, count, NULL, 0);
-    memmove(buf + start, buf + end, *len - end);
-    *len -= count;
+    replace_text(buf, len, start, count, NULL, 0);
     *pos = start;
     sel_mode = 0;
     sel_anchor = -1;
   }
 }
 
+// hex view keys: move by byte or row, hex digits overwrite one nibble
+int hex_key(char *buf, int *len, int *pos, int ch) {
+  int rows = term_rows - 1;
+  int d = -1;
+  if (ch >= '0' && ch <= '9') d = ch - '0';
+  else if (ch >= 'a' && ch <= 'f') d = ch - 'a' + 10;
+  else if (ch >= 'A' && ch <= 'F') d = ch - 'A' + 10;
+
+  if (d >= 0) {
+    if (*pos == *len && *len >= buf_cap - 1) return 1;
+    int lenb = *pos < *len;
+    unsigned char old = lenb ? buf[*pos] : 0;
+    char c = hex_nibble ? (old & 0xF0) | d : (old & 0x0F) | (d << 4);
+    record_change(*pos, buf + *pos, lenb, &c, 1);
+    replace_text(buf, len, *pos, lenb, &c, 1);
+    hex_nibble ^= 1;
+    if (!hex_nibble) (*pos)++;
+    return 1;
+  }
+
+  switch (ch) {
+    case KEY_LEFT: if (*pos > 0 && !hex_nibble) (*pos)--; break;
+    case KEY_RIGHT: if (*pos < *len) (*pos)++; break;
+    case KEY_UP: if (*pos >= 16) *pos -= 16; break;
+    case KEY_DOWN: if (*pos + 16 <= *len) *pos += 16; break;
+    case KEY_PAGEUP: *pos = *pos >= rows * 16 ? *pos - rows * 16 : *pos % 16; break;
+    case KEY_PAGEDOWN: if (*pos + rows * 16 <= *len) *pos += rows * 16; else *pos = *len; break;
+    case KEY_HOME: *pos -= *pos % 16; break;
+    case KEY_END: *pos = *pos - *pos % 16 + 15; if (*pos > *len) *pos = *len; break;
+    case TOP: *pos = 0; break;
+    case BOTTOM: *pos = *len; break;
+
+    // overwrite only: anything that would insert or delete is ignored
+    case 8: case 127: case 9: case 10: case UTF8_CHAR:
+    case DELETE: case CTRL_U: case CTRL_K: case CTRL_V: case CTRL_X: case YANK:
+    case MOUSE_MOVE: case DOUBLE_CLICK: case TRIPLE_CLICK:
+      return 1;
+    default:
+      if (ch >= 32 && ch < 127) return 1;
+      return 0;
+  }
+  hex_nibble = 0;
+  sel_mode = 0;
+  return 1;
+}
+
+// macro playback: one run after another until the mode says stop
+int play_next(char *buf, int *len, int *pos) {
+  int more = 1;
+  if (play_count > 0 && play_count % 256 == 0) {  // a lone Esc stops it
+    int c;
+    while ((c = in_getc_now()) != -1)
+      if (c == 27 && in_getc_now() == -1) more = 0;
+  }
+  if (play_mode == 0) {
+    more = more && play_count < play_runs;
+  } else if (play_mode == 1) {  // until the end, or a run that gets no closer to it
+    more = more && *pos < *len && (play_count == 0 || *len - *pos < play_rest);
+    play_rest = *len - *pos;
+  } else {  // each line: the next one starts after what the last run left of its line
+    int next = play_count == 0 ? *pos : *len - play_rest + 1;
+    more = more && next <= *len - play_tail;
+    if (more) {
+      *pos = next;
+      play_rest = *len - line_end(buf, *len, next);
+    }
+  }
+  if (!more) return 0;
+  play_count++;
+  play_at = 0;
+  return 1;
+}
+
+// the next key: from the macro while one plays, else from the terminal
+#if ZT_COMPLETE
+int pushed_key = 0;  // a key that ended the completion popup
+#endif
+
+int next_key(char *buf, int *len, int *pos) {
+#if ZT_COMPLETE
+  if (pushed_key) {
+    int ch = pushed_key;
+    pushed_key = 0;
+    return ch;
+  }
+#endif
+  while (playing) {
+    if (play_at == macro_len && !play_next(buf, len, pos)) {
+      playing = 0;
+      group_finish(buf, *len);
+      return MACRO_DONE;
+    }
+    struct mkey *k = &macro[play_at++];
+    if (k->ch == UTF8_CHAR) {
+      utf8_input_len = strlen(k->text);
+      memcpy(utf8_input, k->text, utf8_input_len);
+    }
+    return k->ch;
+  }
+
+  int ch;
+#if ZT_THREADS
+  while ((ch = read_key()) == WORKER_DONE) {
+    draw(buf, *len, *pos);
+    fflush(stdout);
+  }
+#else
+  ch = read_key();
+#endif
+  if (recording && ch != 0 && ch < MOUSE_MOVE && ch != RECORD && ch != RUNMACRO &&
+      ch != KEY_ESC && ch != EXITSAVE && ch != NEXTBUF && ch != PREVBUF) {
+    if (macro_len == macro_cap) macro = realloc(macro, (macro_cap = macro_cap * 2 + 64) * sizeof(*macro));
+    macro[macro_len].ch = ch;
+    macro[macro_len].text = ch == UTF8_CHAR ? strndup(utf8_input, utf8_input_len) : NULL;
+    macro_len++;
+  }
+  return ch;
+}
+
+// complete the word before the cursor from the word index: arrows pick,
+// Enter or Tab takes the pick, typing narrows the list, Esc closes it,
+// any other key closes it and then does what it does
+#if ZT_COMPLETE
+int complete(char *buf, int *len, int pos) {
+  for (;;) {
+    int start = pos;
+    while (start > 0 && word_code[(unsigned char)buf[start - 1]]) start--;
+    popup_n = pos - start > 0 && pos - start < WORD_MAX ? words_complete(buf + start, pos - start, popup, 8) : 0;
+    if (!popup_n) {
+      snprintf(status_msg, sizeof(status_msg), "no completions");
+      return pos;
+    }
+    if (popup_sel >= popup_n) popup_sel = popup_n - 1;
+    popup_cols = pos - start;
+    draw(buf, *len, pos);
+    fflush(stdout);
+
+    int ch = next_key(buf, len, &pos);
+    if (ch == KEY_UP || ch == KEY_DOWN) {
+      popup_sel = (popup_sel + (ch == KEY_UP ? popup_n - 1 : 1)) % popup_n;
+    } else if (ch == 10 || ch == 9) {
+      char word[WORD_MAX];
+      int n = popup[popup_sel].len - (pos - start);
+      memcpy(word, wx->arena + popup[popup_sel].off + (pos - start), n);  // the edit may move the arena
+      if (*len + n < buf_cap) {
+        record_change(pos, NULL, 0, word, n);
+        replace_text(buf, len, pos, 0, word, n);
+        pos += n;
+      }
+      break;
+    } else if ((ch == 127 || ch == 8) && pos > start) {
+      record_change(pos - 1, buf + pos - 1, 1, NULL, 0);
+      replace_text(buf, len, pos - 1, 1, NULL, 0);
+      pos--;
+    } else if (ch > 0 && ch < 127 && word_code[ch] && *len + 1 < buf_cap) {
+      char c = ch;
+      record_change(pos, NULL, 0, &c, 1);
+      replace_text(buf, len, pos, 0, &c, 1);
+      pos++;
+    } else {
+      if (ch != KEY_ESC) pushed_key = ch;
+      break;
+    }
+  }
+  popup_n = popup_sel = 0;
+  return pos;
+}
+#endif
+
 void editor(char *buf, int *len) {
   int pos = 0;
-  int lines = 0;
   int done = 0;
+  int prev_key = 0;
   static char search_term[64] = "";
 
   while (!done) {
     draw(buf, *len, pos);
     fflush(stdout);
 
-    int ch = read_key();
-    snprintf(status_msg, sizeof(status_msg), "  ESC exit | F2 save | F7 search | F10 save & exit");
+    int ch = next_key(buf, len, &pos);
+    int last_key = prev_key;
+    prev_key = ch;
+    snprintf(status_msg, sizeof(status_msg), "  ESC close | F2 save | F7 search | F10 save & exit");
     if (sel_persistent) snprintf(status_msg, sizeof(status_msg), "SEL MODE ON");
-
+    if (overwrite) snprintf(status_msg, sizeof(status_msg), "OVERWRITE");
+    if (recording) snprintf(status_msg, sizeof(status_msg), "RECORDING (Alt+M stops)");
+    if (hex_mode && hex_key(buf, len, &pos, ch)) continue;
 
     switch (ch) {
-      case KEY_ESC: //exit without save
-        done = 1;
+      case EXITSAVE:
+        save(buf, *len);
+        // fall through
+      case KEY_ESC: //close without save
+        sel_persistent = 0;
+        buffer_close();
+        if (!nbufs) { done = 1; break; }
+        pos = buffer_enter(&bufs[cur_buf]);
+        buf = bufs[cur_buf].text;
+        len = &bufs[cur_buf].len;
+        break;
+      case SPLIT:
+      case VSPLIT: {
+        int mode = ch == SPLIT ? 1 : 2;
+        if (split == mode) {
+          split = 0;
+          cur_view = 0;  // the focused view is the one that stays
+        } else {
+          if (!split) {
+            views[1].pos = pos;
+            views[1].scroll = scroll;
+            views[1].hscroll = hscroll;
+          }
+          split = mode;
+        }
+        break;
+      }
+      case OTHERVIEW:
+        if (!split) break;
+        views[cur_view].pos = pos;
+        views[cur_view].scroll = scroll;
+        views[cur_view].hscroll = hscroll;
+        cur_view ^= 1;
+        pos = views[cur_view].pos;
+        scroll = views[cur_view].scroll;
+        hscroll = views[cur_view].hscroll;
+        sel_mode = 0;
+        break;
+      case NEXTBUF:
+      case PREVBUF:
+        if (nbufs < 2) break;
+        buffer_park(&bufs[cur_buf], pos);
+        cur_buf = (cur_buf + (ch == NEXTBUF ? 1 : nbufs - 1)) % nbufs;
+        pos = buffer_enter(&bufs[cur_buf]);
+        buf = bufs[cur_buf].text;
+        len = &bufs[cur_buf].len;
         break;
       case SAVE: // save
         save(buf, *len);
+#if ZT_GUTTER
+        if (gx.ch && !dirty_count && !reshaped && disk_len == *len) gutter_rebase(buf, *len);
+#endif
         break;
       case SEARCH: // search
         get_input("search: ", search_term, sizeof(search_term));
@@ -709,9 +4252,13 @@ void editor(char *buf, int *len) {
           }
         }
         break;
-      case EXITSAVE:
-        save(buf, *len);
-        done = 1;
+      case KEY_INSERT:
+        overwrite ^= 1;
+        break;
+      case HEXMODE:
+        hex_mode ^= 1;
+        hex_nibble = 0;
+        sel_mode = 0;
         break;
         
       case 127: // Backspace
@@ -723,15 +4270,14 @@ void editor(char *buf, int *len) {
           } while (pos > 0 && (buf[pos] & 0xC0) == 0x80); 
 
           int clen = start - pos; 
-          memmove(buf + pos, buf + start, *len - start);
-          *len -= clen;
+          replace_text(buf, len, pos, clen, NULL, 0);
         }
         sel_mode = 0;
         break;
               
       case DELETE:
         if (sel_mode && sel_anchor != pos &&
-            (ch == DELETE || (ch >= 32 && ch < 127) || ch == 194 || ch == 195)) {
+            (ch == DELETE || (ch >= 32 && ch < 127) || ch == UTF8_CHAR)) {
           delete_selection(buf, len, &pos);
         }
         if (pos < *len) {
@@ -743,10 +4289,8 @@ void editor(char *buf, int *len) {
           else if ((c & 0xF0) == 0xE0) clen = 3;
           else if ((c & 0xF8) == 0xF0) clen = 4;
 
-          if (pos + clen <= *len) {
-            memmove(buf + pos, buf + pos + clen, *len - (pos + clen));
-            *len -= clen;
-          }
+          if (pos + clen <= *len)
+            replace_text(buf, len, pos, clen, NULL, 0);
         }
         sel_mode = 0;
         break;
@@ -755,9 +4299,10 @@ void editor(char *buf, int *len) {
           int start = line_start(buf, *len, pos);
           int count = pos - start;
           if (count > 0) {
-            record_change(start, buf + start, count, NULL, 0);
-            memmove(buf + start, buf + pos, *len - pos);
-            *len -= count;
+            struct clip *c = clip_new(buf + start, count, 1);
+            kill_push(clip_ref(c));
+            record_clips(start, c, clip_new(NULL, 0, 0));
+            replace_text(buf, len, start, count, NULL, 0);
             buf[*len] = 0;
             pos = start;
             sel_mode = 0;
@@ -770,9 +4315,10 @@ void editor(char *buf, int *len) {
           int end = line_end(buf, *len, pos);
           int count = end - pos;
           if (count > 0) {
-            record_change(pos, buf + pos, count, NULL, 0);
-            memmove(buf + pos, buf + end, *len - end);
-            *len -= count;
+            struct clip *c = clip_new(buf + pos, count, 1);
+            kill_push(clip_ref(c));
+            record_clips(pos, c, clip_new(NULL, 0, 0));
+            replace_text(buf, len, pos, count, NULL, 0);
             buf[*len] = 0;
             sel_mode = 0;
             sel_anchor = -1;
@@ -781,74 +4327,37 @@ void editor(char *buf, int *len) {
       }
         
       case 10: //RETURN
-        if (*len < BUF_SIZE - 1) {
-          memmove(buf + pos + 1, buf + pos, *len - pos);
-          buf[pos++] = '\n';
-          (*len)++;
+        if (*len < buf_cap - 1) {
+          replace_text(buf, len, pos, 0, "\n", 1);
+          pos++;
           draw(buf, *len, pos);
         }
         break;
         
       case KEY_LEFT:
-        if (pos > 0) {
-          do {
-            pos--;
-          } while (pos > 0 && (buf[pos] & 0xC0) == 0x80); 
-        }
+        pos = prev_char(buf, *len, pos);
         sel_mode = 0;
         break;
 
       case KEY_RIGHT:
-        if (pos < *len) {
-          unsigned char c = buf[pos];
-          int clen = 1;
-          if ((c & 0x80) == 0x00) clen = 1;       // ASCII
-          else if ((c & 0xE0) == 0xC0) clen = 2;  // 110xxxxx
-          else if ((c & 0xF0) == 0xE0) clen = 3;  // 1110xxxx
-          else if ((c & 0xF8) == 0xF0) clen = 4;  // 11110xxx
-
-          if (pos + clen <= *len)
-            pos += clen;
-        }
+        pos = next_char(buf, *len, pos);
         sel_mode = 0;
         break;
         
-      case KEY_UP: pos = move_vert(buf, *len, pos, -1); sel_mode = 0; draw(buf, *len, pos); break;
-      case KEY_DOWN: pos = move_vert(buf, *len, pos, +1); sel_mode = 0; draw(buf, *len, pos); break;
+      case KEY_UP: pos = move_vert(buf, *len, pos, -1); sel_mode = 0; break;
+      case KEY_DOWN: pos = move_vert(buf, *len, pos, +1); sel_mode = 0; break;
       
       case MOUSE_MOVE:
-        pos = 0;
-        for (int i = 0; i < mouse_y + scroll - 1; i++) {
-          pos = move_vert(buf, *len, pos, +1); 
-        }
-
-        for (int col = 0; col < mouse_x - 7; col++) {
-          if (pos < *len && buf[pos] != '\n') {
-            int clen = utf8_charlen((unsigned char)buf[pos]);
-            pos += clen;
-          } else break;
-        }
+        pos = mouse_pos(buf, *len);
 
         if (!sel_mode) {
           sel_anchor = pos;
           sel_mode = 1;
         }
-
-        draw(buf, *len, pos);
         break;
 
       case DOUBLE_CLICK: {
-        pos = 0;
-        for (int i = 0; i < mouse_y + scroll - 1; i++) {
-          pos = move_vert(buf, *len, pos, +1);
-        }
-
-        for (int col = 0; col < mouse_x - 7; col++) {
-          if (pos < *len && buf[pos] != '\n') {
-            int clen = utf8_charlen((unsigned char)buf[pos]);
-            pos += clen;
-          } else break;
-        }
+        pos = mouse_pos(buf, *len);
 
         int start = pos;
         while (start > 0) {
@@ -874,14 +4383,7 @@ void editor(char *buf, int *len) {
       }
       
       case TRIPLE_CLICK: {
-        pos = 0;
-        for (int i = 0; i < mouse_y + scroll - 1; i++) {
-          pos = move_vert(buf, *len, pos, +1);
-        }
-        for (int i = 0; i < mouse_x - 7; i++) {
-          if (pos < *len && buf[pos] != '\n') pos++;
-          else break;
-        }
+        pos = mouse_pos(buf, *len);
 
         int start = line_start(buf, *len, pos);
         int end = line_end(buf, *len, pos);
@@ -894,67 +4396,176 @@ void editor(char *buf, int *len) {
       
       case SELECTUP: // select up
         if (!sel_mode) sel_anchor = pos, sel_mode = 1;
-
-        for (int i = 0; i < term_rows - 1 && pos > 0; i++) {
-          // vai indietro di un carattere UTF-8
-          do {
-            pos--;
-          } while (pos > 0 && (buf[pos] & 0xC0) == 0x80); // skip continuation byte
-
-          if (buf[pos] == '\n') {
-            pos++; // torna a inizio riga
-            break;
-          }
-        }
+        pos = line_start(buf, *len, pos) > 0 ? move_vert(buf, *len, pos, -1) : 0;
         break;
 
-        
       case SELECTDOWN: // select down
         if (!sel_mode) sel_anchor = pos, sel_mode = 1;
-
-        for (int i = 0; i < term_rows - 1 && pos < *len; i++) {
-          unsigned char c = buf[pos];
-          int clen = 1;
-          if ((c & 0x80) == 0x00) clen = 1;
-          else if ((c & 0xE0) == 0xC0) clen = 2;
-          else if ((c & 0xF0) == 0xE0) clen = 3;
-          else if ((c & 0xF8) == 0xF0) clen = 4;
-
-          if (buf[pos] == '\n') {
-            pos += clen;
-            break;
-          }
-
-          if (pos + clen <= *len)
-            pos += clen;
-          else
-            break;
-        }
+        pos = line_end(buf, *len, pos) < *len ? move_vert(buf, *len, pos, +1) : *len;
         break;
         
       case SELECTRIGHT: //selectright
         if (!sel_mode) sel_anchor = pos, sel_mode = 1;
-        if (pos < *len) pos++;
+        pos = next_char(buf, *len, pos);
         break;
         
       case SELECTLEFT: //selectleft
         if (!sel_mode) sel_anchor = pos, sel_mode = 1;
-        if (pos > 0) pos--;
+        pos = prev_char(buf, *len, pos);
         break;
         
-      case SELECTHOME: 
-        while (pos > line_start(buf, *len, pos)){ 
+      case SELECTHOME: {
+        int start = line_start(buf, *len, pos);
+        if (pos > start) {
           if (!sel_mode) sel_anchor = pos, sel_mode = 1;
-          if (pos > 0) pos--;
+          pos = start;
         }
         break;
+      }
 
-      case SELECTEND: 
-        while(pos < line_end(buf, *len, pos)){ 
+      case SELECTEND: {
+        int end = line_end(buf, *len, pos);
+        if (pos < end) {
           if (!sel_mode) sel_anchor = pos, sel_mode = 1;
-          if (pos < *len) pos++;
+          pos = end;
+        }
+        break;
+      }
+
+      case LINEOPS: {
+        static char line_cmd[64] = "sort";
+        int from = 0, to = *len;
+        if (sel_mode && sel_anchor != pos) {
+          from = line_start(buf, *len, pos < sel_anchor ? pos : sel_anchor);
+          to = pos > sel_anchor ? pos : sel_anchor;
+          if (to > 0 && buf[to - 1] != '\n') {
+            to = line_end(buf, *len, to);
+            if (to < *len) to++;
+          }
+        }
+        get_input("lines: ", line_cmd, sizeof(line_cmd));
+        if (!line_cmd[0]) break;
+        int end = line_op(buf, len, from, to, line_cmd);
+        if (end >= 0) {
+          sel_anchor = from;
+          pos = end;
+          sel_mode = from < end;
+        }
+        break;
+      }
+
+      case PIPE: {
+        static char pipe_cmd[128] = "";
+        int from = 0, to = *len;
+        if (sel_mode && sel_anchor != pos) {
+          from = pos < sel_anchor ? pos : sel_anchor;
+          to = pos > sel_anchor ? pos : sel_anchor;
+        }
+        get_input("pipe: ", pipe_cmd, sizeof(pipe_cmd));
+        if (!pipe_cmd[0]) break;
+        int end = pipe_range(buf, len, from, to, pipe_cmd);
+        if (end >= 0) {
+          sel_anchor = from;
+          pos = end;
+          sel_mode = from < end;
+        }
+        break;
+      }
+
+      case RECORD:
+        if (!recording) {
+          while (macro_len > 0) free(macro[--macro_len].text);
+          recording = 1;
+          snprintf(status_msg, sizeof(status_msg), "RECORDING (Alt+M stops)");
+        } else {
+          recording = 0;
+          snprintf(status_msg, sizeof(status_msg), "macro: %d keys", macro_len);
+        }
+        break;
+
+      case MACRO_DONE: {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        snprintf(status_msg, sizeof(status_msg), "macro ran %d times (%ld ms)", play_count,
+                 (now.tv_sec - play_start.tv_sec) * 1000 + (now.tv_usec - play_start.tv_usec) / 1000);
+        break;
+      }
+
+      case RUNMACRO: {
+        static char how[16] = "1";
+        if (recording || !macro_len) {
+          snprintf(status_msg, sizeof(status_msg), recording ? "stop recording first" : "no macro");
+          break;
+        }
+        get_input("run macro (N, e = to end, l = each line): ", how, sizeof(how));
+        play_mode = how[0] == 'e' ? 1 : how[0] == 'l' ? 2 : 0;
+        play_runs = atoi(how);
+        if (play_mode == 2) {
+          int from = 0, to = *len;
+          if (sel_mode && sel_anchor != pos) {
+            from = pos < sel_anchor ? pos : sel_anchor;
+            to = pos > sel_anchor ? pos : sel_anchor;
+          }
+          if (to > from && buf[to - 1] == '\n') to--;  // not the empty line after it
+          pos = line_start(buf, *len, from);
+          play_tail = *len - line_end(buf, *len, to);
+        }
+        if (play_mode == 0 && play_runs <= 0) break;
+        sel_mode = 0;
+        play_count = 0;
+        play_at = macro_len;
+        gettimeofday(&play_start, NULL);
+        group_begin();
+        playing = 1;
+        break;
+      }
+
+      case MATCHBRACKET: {
+        int k = brk_at(buf, *len, pos);
+        int m = k >= 0 ? brk_match(k) : -1;
+        if (m >= 0) pos = brk_pos(m);
+        else snprintf(status_msg, sizeof(status_msg), k >= 0 ? "unmatched" : "no bracket here");
+        sel_mode = 0;
+        break;
+      }
+
+      case ENCLOSING: { // again from an open bracket goes one level out
+        int k = brk_enclosing(buf, *len, pos);
+        if (k >= 0) pos = brk_pos(k);
+        else snprintf(status_msg, sizeof(status_msg), "top level");
+        sel_mode = 0;
+        break;
+      }
+
+      case FOLD: pos = fold_toggle(buf, *len, pos); sel_mode = 0; break;
+      case FOLDALL: fold_all(buf, *len); sel_mode = 0; break;
+#if ZT_COMPLETE
+      case COMPLETE: pos = complete(buf, len, pos); sel_mode = 0; break;
+#endif
+#if ZT_GUTTER
+      case NEXTCHANGE: {
+        int l = gx.ch ? gutter_next(line_of(buf, *len, pos)) : -1;
+        if (l >= 0) pos = line_offset(buf, *len, l);
+        else snprintf(status_msg, sizeof(status_msg), "no changes");
+        sel_mode = 0;
+        break;
+      }
+#endif
+
+      case GOTO: {
+        char where[32] = "";
+        line_index_start(buf, *len);  // scans while the answer is typed
+        get_input("go to (line[:col], @offset, N%): ", where, sizeof(where));
+        if (!where[0]) break;
+        int to = goto_pos(buf, *len, where);
+        if (to >= 0) {
+          pos = to;
+          sel_mode = 0;
+        } else {
+          snprintf(status_msg, sizeof(status_msg), "go to LINE[:COL], @OFFSET or N%%");
         }
         break;
+      }
 
       case SELECTALL:
         sel_anchor = 0;
@@ -967,12 +4578,11 @@ void editor(char *buf, int *len) {
         if (sel_mode) {
           int start = (sel_anchor < pos) ? sel_anchor : pos;
           int end = (sel_anchor > pos) ? sel_anchor : pos;
-          int len_copy = end - start;
-          if (len_copy < BUF_SIZE - 1) {
-            memcpy(clipboard, buf + start, len_copy);
-            clipboard[len_copy] = '\0';
-          }
+          struct clip *c = clip_new(buf + start, end - start, 1);
+          set_register(cur_reg, c);
+          osc52_export(c);
         }
+        cur_reg = 0;
         break;
         
       case 9: // TAB
@@ -984,24 +4594,19 @@ void editor(char *buf, int *len) {
           int line_end_pos   = line_end(buf, *len, end);
           int new_pos = pos + 2;
 
-          for (int i = line_start_pos; i <= line_end_pos && *len + 2 < BUF_SIZE; ) {
+          for (int i = line_start_pos; i <= line_end_pos && *len + 2 < buf_cap; ) {
             record_change(i, NULL, 0, "  ", 2);
-            memmove(buf + i + 2, buf + i, *len - i);
-            buf[i] = ' ';
-            buf[i + 1] = ' ';
-            *len += 2;
+            replace_text(buf, len, i, 0, "  ", 2);
 
             i = line_end(buf, *len, i + 2) + 1;
             if (i > *len) break;
           }
           pos = new_pos;
-        } else if (*len + 2 < BUF_SIZE) {
+        } else if (*len + 2 < buf_cap) {
           char text[2] = { ' ', ' ' };
           record_change(pos, NULL, 0, text, 2);
-          memmove(buf + pos + 2, buf + pos, *len - pos);
-          buf[pos++] = ' ';
-          buf[pos++] = ' ';
-          *len += 2;
+          replace_text(buf, len, pos, 0, text, 2);
+          pos += 2;
         }
         break;
       
@@ -1020,30 +4625,60 @@ void editor(char *buf, int *len) {
           int start = sel_anchor < pos ? sel_anchor : pos;
           int end = sel_anchor > pos ? sel_anchor : pos;
           int len_sel = end - start;
-          record_change(start, buf + start, len_sel, NULL, 0);
-          if (len_sel > 0 && len_sel < BUF_SIZE - 1) {
-            memcpy(clipboard, buf + start, len_sel);
-            clipboard[len_sel] = '\0';
-            memmove(buf + start, buf + end, *len - end);
-            *len -= len_sel;
+          if (len_sel > 0) {
+            // one copy of the text, shared by the register and the undo entry
+            struct clip *c = clip_new(buf + start, len_sel, 1);
+            set_register(cur_reg, clip_ref(c));
+            osc52_export(c);
+            record_clips(start, c, clip_new(NULL, 0, 0));
+            replace_text(buf, len, start, len_sel, NULL, 0);
             pos = start;
             sel_mode = 0;
             sel_anchor = -1;
           }
         }
+        cur_reg = 0;
         break;
       case CTRL_V:
         {
-          int len_clip = strlen(clipboard);
-          record_change(pos, NULL, 0, clipboard, len_clip);
-          if (*len + len_clip < BUF_SIZE) {
-            memmove(buf + pos + len_clip, buf + pos, *len - pos);
-            memcpy(buf + pos, clipboard, len_clip);
-            pos += len_clip;
-            *len += len_clip;
+          struct clip *c = reg[cur_reg];
+          cur_reg = 0;
+          if (c && *len + c->len < buf_cap) {
+            clips_edit(buf, pos);  // c may be a slice that the insert would move
+            record_clips(pos, clip_new(NULL, 0, 0), clip_ref(c));
+            replace_text(buf, len, pos, 0, clip_bytes(c), c->len);
+            pos += c->len;
           }
         }
         break;
+      case CTRL_R: { // Ctrl+R a-z: register for the next copy, cut or paste
+        int r = next_key(buf, len, &pos);
+        if (r >= 'a' && r <= 'z') {
+          cur_reg = r - 'a' + 1;
+          snprintf(status_msg, sizeof(status_msg), "register %c", r);
+        }
+        break;
+      }
+      case YANK: { // Alt+y: paste the last kill, repeat to cycle older ones
+        static int yank_pos, yank_len, yank_idx;
+        int again = last_key == YANK && pos == yank_pos + yank_len;
+        int idx = again ? yank_idx : kill_top + 1;
+        for (int k = 0; k < KILL_RING; k++) {
+          idx = (idx + KILL_RING - 1) % KILL_RING;
+          if (kill_ring[idx]) break;
+        }
+        struct clip *c = kill_ring[idx];
+        if (!c) break;
+        if (!again) yank_pos = pos, yank_len = 0;
+        if (*len - yank_len + c->len >= buf_cap) break;
+        clips_edit(buf, yank_pos);
+        record_clips(yank_pos, clip_new(buf + yank_pos, yank_len, 0), clip_ref(c));
+        replace_text(buf, len, yank_pos, yank_len, clip_bytes(c), c->len);
+        yank_idx = idx;
+        yank_len = c->len;
+        pos = yank_pos + yank_len;
+        break;
+      }
       case KEY_HOME: pos = line_start(buf, *len, pos); break;
       case KEY_END: pos = line_end(buf, *len, pos); break;
       
@@ -1051,60 +4686,52 @@ void editor(char *buf, int *len) {
       case BOTTOM: pos = line_end(buf, *len, *len); break;
       
       case KEY_PAGEUP:
-        lines = 0;
-        for (int i = pos; i > 0 && lines < term_rows - 1; i--) {
-          if (buf[i] == '\n') lines++;
-          pos = i;
-        }
-        pos = line_start(buf, *len, pos);
-        break;
-      case KEY_PAGEDOWN:
-        lines = 0;
-        for (int i = pos; i < *len && lines < term_rows - 1; i++) {
-          pos = i;
-          if (buf[i] == '\n') lines++;
-        }
-        pos = line_start(buf, *len, pos);
+      case KEY_PAGEDOWN: {  // by screen rows, so folded lines don't count
+        int row = fold_row(line_of(buf, *len, pos));
+        row += ch == KEY_PAGEUP ? -views[cur_view].rows : views[cur_view].rows;
+        pos = line_offset(buf, *len, fold_line(row < 0 ? 0 : row));
+        int k = fx.nh ? fold_hidden(line_of(buf, *len, pos)) : -1;
+        if (k >= 0) pos = line_offset(buf, *len, fx.h[k].from - 1);  // past the end
         break;
+      }
         
-      case 195: 
-        if (*len < BUF_SIZE - 2) {
-          memmove(buf + pos + 2, buf + pos, *len - pos);
-          buf[pos++] = 195;
-          buf[pos++] = getchar();
-          (*len)+=2;
-        }
-        break;
-      
-      case 194:        
-        if (*len < BUF_SIZE - 2) {
-          memmove(buf + pos + 2, buf + pos, *len - pos);
-          buf[pos++] = 194;
-          buf[pos++] = getchar();
-          (*len)+=2;
+      case UTF8_CHAR:
+        if (sel_mode && sel_anchor != pos) delete_selection(buf, len, &pos);
+        if (*len < buf_cap - 4) {
+          int over = 0;
+          if (overwrite && pos < *len && buf[pos] != '\n') {
+            int w;  // a stray lead byte is one byte, never past the line
+            over = utf8_step(buf + pos, line_end(buf, *len, pos) - pos, &w);
+          }
+          record_change(pos, buf + pos, over, utf8_input, utf8_input_len);
+          replace_text(buf, len, pos, over, utf8_input, utf8_input_len);
+          pos += utf8_input_len;
         }
         break;
 
       case 0: break;
       default:
         if (sel_mode && sel_anchor != pos &&
-            (ch == DELETE || (ch >= 32 && ch < 127) || ch == 194 || ch == 195)) {
+            (ch == DELETE || (ch >= 32 && ch < 127) || ch == UTF8_CHAR)) {
           delete_selection(buf, len, &pos);
         }
-        if (ch >= 32 && ch < 127 && *len < BUF_SIZE - 1) {
+        if (ch >= 32 && ch < 127 && *len < buf_cap - 1) {
           char after[1] = { ch };
-          record_change(pos, buf + pos, 0, after, 1);
-          memmove(buf + pos + 1, buf + pos, *len - pos);
-          buf[pos++] = ch;
-          (*len)++;
+          int over = 0;
+          if (overwrite && pos < *len && buf[pos] != '\n') {
+            int w;  // a stray lead byte is one byte, never past the line
+            over = utf8_step(buf + pos, line_end(buf, *len, pos) - pos, &w);
+          }
+          record_change(pos, buf + pos, over, after, 1);
+          replace_text(buf, len, pos, over, after, 1);
+          pos++;
         }
     }
   }
 }
 
 int main(int argc, char *argv[]) {
-  char buf[BUF_SIZE];
-  int len = 0;
+  if (argc == 3 && !strcmp(argv[1], "--ztwrite")) return ztwrite(argv[2]);
 
   struct termios orig, raw;
   tcgetattr(0, &orig);
@@ -1117,31 +4744,21 @@ int main(int argc, char *argv[]) {
   
   printf("\033[5 q"); 
 
-  if (argc > 1) {
-    filename = argv[1];
-    
-    const char *ext = get_extension(filename);
-    if (strcmp(ext, "c") == 0 || strcmp(ext, "h") == 0) language = "c";
-    if (strcmp(ext, "py") == 0) language = "python";
-    
-    load_keywords(ext);
-
-    FILE *f = fopen(filename, "r");
-    if (f) {
-      len = fread(buf, 1, BUF_SIZE, f);
-      fclose(f);
-      snprintf(status_msg, sizeof(status_msg), "File %s loaded (%d byte)(%s)", filename, len,language);
-    } else {
-      snprintf(status_msg, sizeof(status_msg), "New file: %s", filename);
+  for (int i = 1; i < argc; i++) {
+    if (!buffer_open(argv[i])) {
+      fprintf(stderr, "%s: cannot open (too large or too many files)\r\n", argv[i]);
+      return 1;
     }
-  } else {
-    snprintf(status_msg, sizeof(status_msg), "new file (no name)");
   }
+  if (argc < 2) buffer_open(NULL);
+  cur_buf = 0;
+  buffer_enter(&bufs[0]);
 
   printf("\033[2J\033[H");       
   raw_mode(1);       
+  term_detect();
   get_terminal_size();          
-  editor(buf, &len);           
+  editor(bufs[0].text, &bufs[0].len);
   raw_mode(0);                  
   printf("\033[0m\033[2J\033[H"); 
   printf("\033[0 q"); 